@@ -0,0 +1,348 @@
+#include <sys/stat.h>
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+#include "bml_selector.h"
+#include "layer.h"
+#include "metrics.h"
+#include "packed_ref_seq.h"
+#include "short_read_mapper.h"
+
+/*
+Benchmarks that need no external data. A synthetic reference and ART-like
+.aln reads are generated into bench_data/, then:
+
+- Layer::update and Layer::query on the seeds of the reference
+- BMLSelector::smith_waterman and the striped kernel on read windows
+- training and mapping the reads end to end with a small geometry
+
+Everything is generated from a fixed seed, so two commits do the same work
+and print the same checksums; only the throughputs differ. Each
+microbenchmark reports the best of BENCH_ROUNDS rounds.
+
+usage: bench [key=value ...], with the keys of the configuration below.
+*/
+
+#define BENCH_ROUNDS 3
+
+static const char bases[] = "ACGT";
+
+struct BenchConfig {
+    long genome_len;
+    long read_num;
+    long read_len;
+
+    // Per base of a read
+    double sub_rate;
+    double indel_rate;
+
+    // Copies of random segments of the genome, and the length of a
+    // satellite made of one 171-base unit
+    long repeat_num;
+    long satellite_len;
+
+    int thread_num;
+    int seed;
+};
+
+static string genGenome(BenchConfig& config, mt19937& rng) {
+    long len = config.genome_len;
+    string genome(len, 'A');
+    for (long i = 0; i < len; i++) {
+        genome[i] = bases[rng() % 4];
+    }
+
+    // Segmental repeats
+    for (long r = 0; r < config.repeat_num; r++) {
+        long seg_len = 300 + rng() % 2700;
+        if (seg_len >= len) break;
+        long src = rng() % (len - seg_len);
+        long dst = rng() % (len - seg_len);
+        genome.replace(dst, seg_len, genome.substr(src, seg_len));
+    }
+
+    // Satellite at a third of the genome, an N run at the middle
+    string unit(171, 'A');
+    for (int i = 0; i < unit.size(); i++) {
+        unit[i] = bases[rng() % 4];
+    }
+    long sat_begin = len / 3;
+    for (long i = 0; i < config.satellite_len && sat_begin + i < len; i++) {
+        genome[sat_begin + i] = unit[i % unit.size()];
+    }
+    for (long i = len / 2; i < min(len, len / 2 + 5000); i++) {
+        genome[i] = 'N';
+    }
+    return genome;
+}
+
+static void writeGenome(const string& genome, string path) {
+    // Soft-masked start, 60 bases per line
+    ofstream os(path);
+    os << ">chr1 synthetic\n";
+    for (long i = 0; i < genome.size(); i += 60) {
+        string line = genome.substr(i, 60);
+        if (i < 1000) {
+            for (int j = 0; j < line.size(); j++) line[j] = tolower(line[j]);
+        }
+        os << line << "\n";
+    }
+}
+
+static void writeReads(BenchConfig& config, const string& genome,
+                       mt19937& rng, string path) {
+    /*
+    Reads in the ART .aln format: '-' marks gaps in both aligned lines,
+    and '-' strand reads are aligned to the reverse complemented contig.
+    */
+    uniform_real_distribution<double> uniform(0, 1);
+    long len = genome.size();
+    long margin = config.read_len * 2;
+    ofstream os(path);
+    os << "##ARTv2.5.8\n@CM\tbench\n@SQ\tchr1\t" << len << "\n##Header End\n";
+    for (long n = 0; n < config.read_num;) {
+        long pos = rng() % (len - margin);
+        if (genome.find('N', pos) < pos + margin) continue;
+
+        string ref_aln;
+        string read_aln;
+        long j = pos;
+        for (long read_base = 0; read_base < config.read_len;) {
+            double x = uniform(rng);
+            if (x < config.indel_rate / 2 && read_base > 5) {
+                // Insertion in the read
+                ref_aln += '-';
+                read_aln += bases[rng() % 4];
+                read_base++;
+            }
+            else if (x < config.indel_rate && read_base > 5) {
+                // Deletion from the read
+                ref_aln += genome[j++];
+                read_aln += '-';
+            }
+            else {
+                char base = genome[j++];
+                ref_aln += base;
+                read_aln += uniform(rng) < config.sub_rate ? bases[rng() % 4]
+                                                           : base;
+                read_base++;
+            }
+        }
+
+        char strand = rng() % 2 ? '-' : '+';
+        if (strand == '-') {
+            string rc;
+            reverseComplement(ref_aln, rc);
+            ref_aln.swap(rc);
+            reverseComplement(read_aln, rc);
+            read_aln.swap(rc);
+            pos = len - j;
+        }
+        os << ">chr1\tchr1-" << n << "\t" << pos << "\t" << strand << "\n"
+           << ref_aln << "\n" << read_aln << "\n";
+        n++;
+    }
+}
+
+static vector<uint64_t> genSeeds(const string& genome, int seed_len) {
+    // Seed ending at each base, non-ACGT bases do not shift it
+    uint64_t mask = (1ULL << (2 * seed_len)) - 1;
+    vector<uint64_t> seeds(genome.size());
+    uint64_t seed = 0;
+    for (long i = 0; i < genome.size(); i++) {
+        const char* base = strchr(bases, genome[i]);
+        if (base) seed = ((seed << 2) | (base - bases)) & mask;
+        seeds[i] = seed;
+    }
+    return seeds;
+}
+
+static void report(string name, double value, string unit, string check) {
+    cout << "[bench] " << left << setw(20) << name << right << fixed
+         << setprecision(2) << setw(10) << value << " " << left << setw(12)
+         << unit << right << check << endl;
+}
+
+static void benchLayer(const string& genome) {
+    /*
+    One layer of 256 Bloom filters of 64 kB per group, each covering
+    4096 bases, as large as the genome needs.
+    */
+    long bf_size = 64 * 1024 * 8;
+    long bf_amount = 256;
+    long seed_range = 4096;
+    long group_range = bf_amount * seed_range;
+    long group_num = (genome.size() + group_range - 1) / group_range;
+    uint64_t hash_factor = 0x9e3779b97f4a7c15ULL;
+    MemConfig mem_config = {TRANSPARENT_HUGE_PAGES, NUMA_LOCAL, 0};
+    vector<uint64_t> seeds = genSeeds(genome, 20);
+    long seed_num = seeds.size();
+
+    double best_update = 1e30;
+    double best_query = 1e30;
+    long hit_sum = 0;
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        Layer layer(bf_size, bf_amount, group_num * bf_amount, seed_range,
+                    hash_factor, 1);
+        layer.allocate(mem_config, -1);
+
+        double start = Timer::now();
+        for (long i = 0; i < seed_num; i++) {
+            layer.update(seeds[i], i);
+        }
+        best_update = min(best_update, Timer::now() - start);
+
+        // Query every 16th seed of the genome in the group it was
+        // trained in
+        vector<uint8_t> hit_cnt(bf_amount);
+        hit_sum = 0;
+        start = Timer::now();
+        for (long i = 0; i < seed_num; i += 16) {
+            long hier_offset = (i / group_range) * bf_amount * bf_size;
+            fill(hit_cnt.begin(), hit_cnt.end(), 0);
+            layer.query(seeds[i], hit_cnt.data(), hier_offset, false);
+            for (int b = 0; b < bf_amount; b++) hit_sum += hit_cnt[b];
+        }
+        best_query = min(best_query, Timer::now() - start);
+    }
+    report("layer_update", seed_num / best_update / 1e6, "Mseeds/s", "");
+    ostringstream check;
+    check << "hits " << hit_sum;
+    report("layer_query", seed_num / 16 / best_query / 1e6, "Mqueries/s",
+           check.str());
+}
+
+static void benchSmithWaterman(const string& genome, mt19937& rng) {
+    // 100-base reads against 512-base windows around their origin
+    int read_len = 100;
+    int window_len = 512;
+    int pair_num = 2000;
+    vector<string> reads(pair_num);
+    vector<string> windows(pair_num);
+    for (int p = 0; p < pair_num; p++) {
+        long pos = rng() % (genome.size() - window_len);
+        windows[p] = genome.substr(pos, window_len);
+        reads[p] = windows[p].substr(rng() % (window_len - read_len),
+                                     read_len);
+        for (int i = 0; i < read_len; i += 20 + rng() % 20) {
+            reads[p][i] = bases[rng() % 4];
+        }
+    }
+    double cells = (double)pair_num * read_len * window_len;
+
+    BMLSelector sel(20);
+    double best_scalar = 1e30;
+    double best_striped = 1e30;
+    long score_sum = 0;
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        uint32_t row, col;
+        score_sum = 0;
+        double start = Timer::now();
+        for (int p = 0; p < pair_num; p++) {
+            score_sum += sel.smith_waterman(windows[p], reads[p], row, col);
+        }
+        best_scalar = min(best_scalar, Timer::now() - start);
+
+        start = Timer::now();
+        for (int p = 0; p < pair_num; p++) {
+            sel.init();
+            sel.setRead(reads[p]);
+            sel.smith_waterman_striped(windows[p], row, col);
+        }
+        best_striped = min(best_striped, Timer::now() - start);
+    }
+    ostringstream check;
+    check << "scores " << score_sum;
+    report("sw_scalar", cells / best_scalar / 1e9, "GCUPS", check.str());
+    report("sw_striped", cells / best_striped / 1e9, "GCUPS", "");
+}
+
+static void benchMapper(BenchConfig& config, string dir) {
+    // Small geometry, so that the layers fit in a few hundred MB
+    string config_path = dir + "/layers.cfg";
+    ofstream cfg(config_path);
+    cfg << "cml_range 256\nlayer 2097152 32\nlayer 65536 32\nlayer 256 256\n";
+    cfg.close();
+
+    string ref_path = dir + "/ref.fa";
+    string read_path = dir + "/reads.aln";
+    ShortReadMapper mapper(ref_path, read_path, config.read_len, 20, 1, 70,
+                           20, 15);
+    mapper.loadLayerConfig(config_path);
+    mapper.setThreadNum(config.thread_num);
+    mapper.trainBF(false);
+    mapper.mapRead();
+    mapper.displayResult();
+    mapper.writeMetrics(dir + "/metrics.json");
+}
+
+static void parseArgs(int argc, char const* argv[], BenchConfig& config) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string key = arg.substr(0, eq);
+        double value = eq == string::npos ? 0 : atof(arg.c_str() + eq + 1);
+        if (key == "genome_len")
+            config.genome_len = value;
+        else if (key == "read_num")
+            config.read_num = value;
+        else if (key == "sub_rate")
+            config.sub_rate = value;
+        else if (key == "indel_rate")
+            config.indel_rate = value;
+        else if (key == "repeat_num")
+            config.repeat_num = value;
+        else if (key == "satellite_len")
+            config.satellite_len = value;
+        else if (key == "thread_num")
+            config.thread_num = value;
+        else if (key == "seed")
+            config.seed = value;
+        else {
+            cerr << "[parseArgs] Unknown option " << arg << endl;
+            exit(1);
+        }
+    }
+    if (config.genome_len < 1000000 || config.read_num < 1 ||
+        config.thread_num < 1) {
+        cerr << "[parseArgs] Needs genome_len >= 1000000, read_num >= 1 and "
+                "thread_num >= 1"
+             << endl;
+        exit(1);
+    }
+}
+
+int main(int argc, char const* argv[]) {
+    BenchConfig config;
+    config.genome_len = 4000000;
+    config.read_num = 25000;
+    config.read_len = 100;
+    config.sub_rate = 0.01;
+    config.indel_rate = 0.001;
+    config.repeat_num = 20;
+    config.satellite_len = 20000;
+    config.thread_num = 1;
+    config.seed = 7;
+    parseArgs(argc, argv, config);
+
+    string dir = "bench_data";
+    mkdir(dir.c_str(), 0755);
+    mt19937 rng(config.seed);
+    string genome = genGenome(config, rng);
+    writeGenome(genome, dir + "/ref.fa");
+    writeReads(config, genome, rng, dir + "/reads.aln");
+    cout << "[bench] Generated " << config.genome_len << " bases and "
+         << config.read_num << " reads in " << dir << endl;
+
+    benchLayer(genome);
+    benchSmithWaterman(genome, rng);
+    benchMapper(config, dir);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#!/bin/bash
+# Compare one-hash Bloom filters with blocked Bloom filters, see layer.h.
+# usage: ./bench_bloom.sh [hashes[:hit_threshold] ...]
+# e.g.   ./bench_bloom.sh 1 2 3 2:50
+# First prints the false positive rate of the last layer of layers.cfg on
+# the reference, then maps the reads with every layer using the given
+# number of hashes. The hit threshold overrides hit_threshold of main.cpp.
+# Every configuration is built from a copy of the sources and trains its
+# own temporary index.
+set -e
+
+CONFIGS="$@"
+[ -z "$CONFIGS" ] && CONFIGS="1 2 3 4"
+
+SRC_DIR=$(cd "$(dirname "$0")" && pwd)
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# Paths in main.cpp are relative to the source directory
+ref_path=$(sed -n 's|.*string ref_path = "\(.*\)";|\1|p' "$SRC_DIR/main.cpp")
+last_layer=$(awk '$1 == "cml_range" {range = $2}
+                  $1 == "layer" {bytes = $2; amount = $3}
+                  END {print bytes, amount, range}' "$SRC_DIR/layers.cfg")
+g++ -std=c++11 -O3 -pthread -o "$WORK_DIR/bloom_bench" \
+    "$SRC_DIR/bloom_bench.cpp" "$SRC_DIR/layer.cpp" \
+    "$SRC_DIR/fasta_reader.cpp" "$SRC_DIR/packed_ref_seq.cpp" \
+    "$SRC_DIR/mem_alloc.cpp"
+(cd "$SRC_DIR" && "$WORK_DIR/bloom_bench" "$ref_path" $last_layer) || true
+echo
+
+printf "%6s %9s %12s %9s %8s %8s %10s %10s %8s\n" Hashes Threshold \
+    Queries/read CMLs/read Correct Wrong Satellite "Not mapped" Seeding
+for config in $CONFIGS; do
+    IFS=: read hash_num threshold <<< "$config"
+
+    build_dir="$WORK_DIR/$hash_num-$threshold"
+    mkdir -p "$build_dir"
+    cp "$SRC_DIR"/*.h "$SRC_DIR"/*.cpp "$SRC_DIR"/makefile "$build_dir"
+    awk -v k="$hash_num" '$1 == "layer" {$4 = k} {print}' \
+        "$SRC_DIR/layers.cfg" > "$build_dir/layers.cfg"
+    sed -i "s|string index_path = .*;|string index_path = \"$build_dir/index.idx\";|;
+            s|string layer_config_path = .*;|string layer_config_path = \"$build_dir/layers.cfg\";|" \
+        "$build_dir/main.cpp"
+    if [ -n "$threshold" ]; then
+        sed -i "s|long hit_threshold = .*;|long hit_threshold = $threshold;|" \
+            "$build_dir/main.cpp"
+    fi
+    make -s -C "$build_dir" main >/dev/null
+
+    out=$(cd "$SRC_DIR" && "$build_dir/short_read_mapper")
+    field() { echo "$out" | grep "^$1" | awk '{print $NF}'; }
+    printf "%6s %9s %12s %9s %8s %8s %10s %10s %8s\n" "$hash_num" \
+        "${threshold:--}" "$(field Queries/read)" "$(field CMLs/read)" \
+        "$(field 'Correctly mapped')" "$(field 'Wrongly mapped')" \
+        "$(field Satellite)" "$(field 'Not mapped')" "$(field Seeding)"
+    rm -f "$build_dir/index.idx"
+done
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Compare seed selections on the mapping scoreboard.
+# usage: ./bench_seeds.sh [mode:param[:share] ...]
+# e.g.   ./bench_seeds.sh STRIDE_SEEDS:1 STRIDE_SEEDS:4 MINIMIZER_SEEDS:10:0.5
+# The stride of STRIDE_SEEDS is the query shift. The share overrides
+# sampled_hit_share of minimizers and syncmers, so that it can be
+# calibrated. Every selection is built from a copy of the sources and
+# trains its own temporary index.
+set -e
+
+CONFIGS="$@"
+if [ -z "$CONFIGS" ]; then
+    CONFIGS="STRIDE_SEEDS:1 STRIDE_SEEDS:2 STRIDE_SEEDS:4 MINIMIZER_SEEDS:5
+             MINIMIZER_SEEDS:10 SYNCMER_SEEDS:12 SYNCMER_SEEDS:16"
+fi
+
+SRC_DIR=$(cd "$(dirname "$0")" && pwd)
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+printf "%-18s %5s %5s %10s %12s %8s %8s %10s %10s %8s\n" Selection Param \
+    Share Seeds/read Queries/read Correct Wrong Satellite "Not mapped" Seeding
+for config in $CONFIGS; do
+    IFS=: read mode param share <<< "$config"
+    shift_amt=1
+    [ "$mode" = STRIDE_SEEDS ] && shift_amt=$param
+
+    build_dir="$WORK_DIR/$mode-$param-$share"
+    mkdir -p "$build_dir"
+    cp "$SRC_DIR"/*.h "$SRC_DIR"/*.cpp "$SRC_DIR"/makefile "$build_dir"
+    sed -i "s|long query_shift_amt = .*;|long query_shift_amt = $shift_amt;|;
+            s|SeedSelectMode seed_select_mode = .*;|SeedSelectMode seed_select_mode = $mode;|;
+            s|int seed_select_param = .*;|int seed_select_param = $param;|;
+            s|string index_path = .*;|string index_path = \"$build_dir/index.idx\";|" \
+        "$build_dir/main.cpp"
+    if [ -n "$share" ]; then
+        sed -i "s|double sampled_hit_share = .*;|double sampled_hit_share = $share;|" \
+            "$build_dir/main.cpp"
+    fi
+    make -s -C "$build_dir" main >/dev/null
+
+    # Paths in main.cpp are relative to the source directory
+    out=$(cd "$SRC_DIR" && "$build_dir/short_read_mapper")
+    field() { echo "$out" | grep "^$1" | awk '{print $NF}'; }
+    printf "%-18s %5s %5s %10s %12s %8s %8s %10s %10s %8s\n" "$mode" "$param" \
+        "${share:--}" \
+        "$(field Seeds/read)" "$(field Queries/read)" \
+        "$(field 'Correctly mapped')" "$(field 'Wrongly mapped')" \
+        "$(field Satellite)" "$(field 'Not mapped')" "$(field Seeding)"
+    rm -f "$build_dir/index.idx"
+done
@@ -0,0 +1,122 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <unordered_set>
+#include <vector>
+
+#include "fasta_reader.h"
+#include "layer.h"
+#include "packed_ref_seq.h"
+
+/*
+False positive rate of one layer of Bloom filters, with one hash and as
+blocked Bloom filters with several hashes, see layer.h.
+
+The seeds of the first groups of sibling Bloom filters of the reference
+are trained, as trainBF() does. Each group is then queried with the seeds
+of the next group, which are real DNA but mostly not in it. A hit of a
+Bloom filter that does not hold the seed is a false positive.
+
+usage: bloom_bench <reference> [bf_bytes bf_amount seed_range [groups]]
+The default geometry is the last layer of layers.cfg.
+*/
+
+static uint64_t truthKey(uint64_t seed, long bf) { return seed * 1000003 + bf; }
+
+int main(int argc, char const* argv[]) {
+    if (argc != 2 && argc != 5 && argc != 6) {
+        cerr << "usage: " << argv[0]
+             << " <reference> [bf_bytes bf_amount seed_range [groups]]"
+             << endl;
+        exit(1);
+    }
+    long bf_size = 256 * 8;
+    long bf_amount = 256;
+    long seed_range = 256;
+    long group_num = 16;
+    if (argc >= 5) {
+        bf_size = atol(argv[2]) * 8;
+        bf_amount = atol(argv[3]);
+        seed_range = atol(argv[4]);
+    }
+    if (argc == 6) group_num = atol(argv[5]);
+    int seed_len = 20;
+    uint64_t seed_mask = (1ULL << (2 * seed_len)) - 1;
+    MemConfig mem_config = {TRANSPARENT_HUGE_PAGES, NUMA_LOCAL, 0};
+
+    // Seeds ending at each base of the trained groups and the next one
+    long group_range = seed_range * bf_amount;
+    long base_num = (group_num + 1) * group_range;
+    PackedRefSeq ref(base_num + seed_len, mem_config);
+    FastaReader reader(argv[1]);
+    if (!reader.open()) {
+        cerr << "[main] Cannot open " << argv[1] << endl;
+        exit(1);
+    }
+    long ref_len = reader.read(&ref, base_num + seed_len);
+    if (ref_len < base_num + seed_len) {
+        cerr << "[main] " << argv[1] << " is shorter than " << group_num + 1
+             << " groups of " << group_range << " bases" << endl;
+        exit(1);
+    }
+    vector<int8_t> codes;
+    ref.extractCodes(0, base_num + seed_len, codes);
+    vector<uint64_t> seeds(base_num);
+    uint64_t seed = 0;
+    for (long i = 0; i < base_num + seed_len; i++) {
+        if (codes[i] >= 0) seed = ((seed << 2) | codes[i]) & seed_mask;
+        if (i >= seed_len - 1 && i - seed_len + 1 < base_num)
+            seeds[i - seed_len + 1] = seed;
+    }
+
+    // Which Bloom filter holds which seed
+    unordered_set<uint64_t> truth;
+    for (long b = 0; b < group_num * group_range; b++) {
+        truth.insert(truthKey(seeds[b], b / seed_range));
+    }
+
+    cout << "[main] " << group_num << " groups of " << bf_amount << " Bloom "
+         << "filters of " << bf_size / 8 << " bytes, " << seed_range
+         << " seeds each" << endl;
+    cout << setw(6) << "Hashes" << setw(12) << "FPR" << setw(12) << "ns/query"
+         << endl;
+    uint64_t hash_factor = 0x9e3779b97f4a7c15ULL;
+    vector<uint8_t> hit_cnt(bf_amount);
+    for (int hash_num = 1; hash_num <= BLOCK_MAX_HASH; hash_num++) {
+        Layer layer(bf_size, bf_amount, group_num * bf_amount, seed_range,
+                    hash_factor, hash_num);
+        layer.allocate(mem_config, -1);
+        for (long b = 0; b < group_num * group_range; b++) {
+            layer.update(seeds[b], b);
+        }
+
+        long false_hit = 0;
+        long negative = 0;
+        double query_sec = 0;
+        for (long g = 0; g < group_num; g++) {
+            long hier_offset = g * bf_amount * bf_size;
+            for (long b = (g + 1) * group_range; b < (g + 2) * group_range;
+                 b++) {
+                fill(hit_cnt.begin(), hit_cnt.end(), 0);
+                chrono::steady_clock::time_point start =
+                    chrono::steady_clock::now();
+                layer.query(seeds[b], hit_cnt.data(), hier_offset, false);
+                query_sec += chrono::duration<double>(
+                                 chrono::steady_clock::now() - start)
+                                 .count();
+                for (long i = 0; i < bf_amount; i++) {
+                    long bf = g * bf_amount + i;
+                    if (truth.count(truthKey(seeds[b], bf))) continue;
+                    negative++;
+                    false_hit += hit_cnt[i];
+                }
+            }
+        }
+        cout << setw(6) << hash_num << setw(12) << fixed << setprecision(6)
+             << (double)false_hit / negative << setw(12) << setprecision(1)
+             << query_sec * 1e9 / (group_num * group_range) << endl;
+    }
+    return 0;
+}
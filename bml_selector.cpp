@@ -1,25 +1,587 @@
 #include "bml_selector.h"
 
+#include <algorithm>
+#include <climits>
+#include <cstring>
 #include <vector>
 
-BMLSelector::BMLSelector() { init(); }
+#include "packed_ref_seq.h"
 
-BMLSelector::~BMLSelector() {}
+// 16-bit lanes in a 128-bit vector
+#define SW_LANES 8
+
+// Low enough to never win a max, high enough to never saturate
+#define SW_NEG_INF -1000
+
+// Longest reference window the striped kernel can index with 16 bits
+#define SW_MAX_REF_LEN 32767
+
+// Candidate states of the ungapped pre-check
+#define CAND_ALIGN 0
+#define CAND_SETTLED 1
+#define CAND_HOPELESS 2
+
+// 2-bit code of a base, -1 for anything but ACGT
+static inline int baseCode(char base) {
+    switch (base) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default: return -1;
+    }
+}
+
+// 64 bits of a packed sequence starting at bit, the last word is padding
+static inline uint64_t getBits(const vector<uint64_t> &packed, long bit) {
+    long word = bit >> 6;
+    int shift = bit & 63;
+    if (shift == 0) return packed[word];
+    return (packed[word] >> shift) | (packed[word + 1] << (64 - shift));
+}
+
+#ifdef __SSE2__
+/*
+Vector of one 16-bit lane per candidate window in a batch. The batch
+kernels are templates over the vector type: __m128i everywhere, __m256i
+on CPUs with AVX2. The helpers are overloaded on it, and bvLoad/bvSet
+take the type explicitly.
+*/
+#define BATCH_MAX_LANES 16
+
+// The __m256i instantiations are only ever inlined into AVX2 functions
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+template <typename V>
+static inline V bvLoad(const int16_t *p);
+template <typename V>
+static inline V bvSet(int16_t x);
+
+template <>
+inline __m128i bvLoad<__m128i>(const int16_t *p) {
+    return _mm_loadu_si128((const __m128i *)p);
+}
+template <>
+inline __m128i bvSet<__m128i>(int16_t x) {
+    return _mm_set1_epi16(x);
+}
+static inline void bvStore(int16_t *p, __m128i v) {
+    _mm_storeu_si128((__m128i *)p, v);
+}
+static inline __m128i bvAdds(__m128i a, __m128i b) {
+    return _mm_adds_epi16(a, b);
+}
+static inline __m128i bvMax(__m128i a, __m128i b) {
+    return _mm_max_epi16(a, b);
+}
+static inline __m128i bvGt(__m128i a, __m128i b) {
+    return _mm_cmpgt_epi16(a, b);
+}
+static inline __m128i bvEq(__m128i a, __m128i b) {
+    return _mm_cmpeq_epi16(a, b);
+}
+static inline __m128i bvAnd(__m128i a, __m128i b) {
+    return _mm_and_si128(a, b);
+}
+static inline __m128i bvBlend(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+template <>
+TARGET_AVX2 inline __m256i bvLoad<__m256i>(const int16_t *p) {
+    return _mm256_loadu_si256((const __m256i *)p);
+}
+template <>
+TARGET_AVX2 inline __m256i bvSet<__m256i>(int16_t x) {
+    return _mm256_set1_epi16(x);
+}
+TARGET_AVX2 static inline void bvStore(int16_t *p, __m256i v) {
+    _mm256_storeu_si256((__m256i *)p, v);
+}
+TARGET_AVX2 static inline __m256i bvAdds(__m256i a, __m256i b) {
+    return _mm256_adds_epi16(a, b);
+}
+TARGET_AVX2 static inline __m256i bvMax(__m256i a, __m256i b) {
+    return _mm256_max_epi16(a, b);
+}
+TARGET_AVX2 static inline __m256i bvGt(__m256i a, __m256i b) {
+    return _mm256_cmpgt_epi16(a, b);
+}
+TARGET_AVX2 static inline __m256i bvEq(__m256i a, __m256i b) {
+    return _mm256_cmpeq_epi16(a, b);
+}
+TARGET_AVX2 static inline __m256i bvAnd(__m256i a, __m256i b) {
+    return _mm256_and_si256(a, b);
+}
+TARGET_AVX2 static inline __m256i bvBlend(__m256i mask, __m256i a,
+                                          __m256i b) {
+    return _mm256_blendv_epi8(b, a, mask);
+}
+
+#endif
+
+BMLSelector::BMLSelector(int seed_len) {
+    _seed_len = seed_len;
+#ifdef __SSE2__
+    /*
+    A batch of a 100bp read against 512bp windows costs about as much as
+    aligning 8 to 10 of them one by one with the striped kernel. With 16
+    AVX2 lanes batches pay off from 10 windows on, with 8 SSE2 lanes
+    only full batches break even.
+    */
+    _batch_lanes = cpuHasAVX2() ? 16 : 8;
+    _batch_min_cand = cpuHasAVX2() ? 10 : 8;
+#endif
+    _read_packable = false;
+    _band_width = 0;
+    _ungapped_read_cnt = 0;
+    _gapped_read_cnt = 0;
+    _banded_cand_cnt = 0;
+    _full_cand_cnt = 0;
+    _dp_cell_cnt = 0;
+#ifdef __SSE2__
+    _seg_len = 0;
+    _prof_num = 0;
+    _profile = NULL;
+    _profile_cap = 0;
+    _h_store = NULL;
+    _h_load = NULL;
+    _m_col = NULL;
+    _d_col = NULL;
+    _i_col = NULL;
+    _best = NULL;
+    _best_col = NULL;
+    _col_cap = 0;
+#endif
+    init();
+}
+
+BMLSelector::~BMLSelector() {
+#ifdef __SSE2__
+    _mm_free(_profile);
+    _mm_free(_h_store);
+    _mm_free(_h_load);
+    _mm_free(_m_col);
+    _mm_free(_d_col);
+    _mm_free(_i_col);
+    _mm_free(_best);
+    _mm_free(_best_col);
+#endif
+}
+
+void BMLSelector::setBandWidth(int band_width) { _band_width = band_width; }
 
 void BMLSelector::init() {
     _max_score = 0;
     _map_loc = 0;
+    _map_strand = FORWARD_STRAND;
+    _map_cand = -1;
+    _cand_num = 0;
 }
 
-void BMLSelector::update(const string &ref_seq, const string &read,
-                         long cml_loc) {
-    uint32_t temp_end_row = 0;
-    uint32_t temp_end_col = 0;
-    int new_score = smith_waterman(ref_seq, read, temp_end_row, temp_end_col);
+void BMLSelector::setRead(const string &read) {
+    // Reverse complement for the reverse strand, other bases are kept
+    reverseComplement(read, _strand_read[REVERSE_STRAND]);
+    _strand_read[FORWARD_STRAND] = read;
+
+    _strand = -1;
+    useStrand(FORWARD_STRAND);
+}
+
+void BMLSelector::useStrand(int strand) {
+    // Build the seeds and the profile of the read of this strand
+    if (strand == _strand) return;
+    _strand = strand;
+    _read = _strand_read[strand];
+    buildSeeds();
+#ifdef __SSE2__
+    buildProfile();
+#endif
+}
+
+void BMLSelector::buildSeeds() {
+    int read_len = _read.size();
+    _read_packable = _seed_len > 0 && _seed_len <= 32 && read_len >= _seed_len;
+    _read_packed.assign(read_len / 32 + 2, 0);
+    for (int i = 0; i < read_len && _read_packable; i++) {
+        int code = baseCode(_read[i]);
+        if (code < 0) {
+            _read_packable = false;
+        }
+        else {
+            _read_packed[i / 32] |= (uint64_t)code << (2 * (i % 32));
+        }
+    }
+    _read_seeds.clear();
+    if (!_read_packable) return;
+
+    // Every seed of the read with its position, sorted for lookup
+    uint64_t seed_mask =
+        _seed_len == 32 ? ~0ULL : (1ULL << (2 * _seed_len)) - 1;
+    uint64_t seed = 0;
+    for (int i = 0; i < read_len; i++) {
+        seed = ((seed << 2) | baseCode(_read[i])) & seed_mask;
+        if (i >= _seed_len - 1) {
+            _read_seeds.push_back(make_pair(seed, i - _seed_len + 1));
+        }
+    }
+    sort(_read_seeds.begin(), _read_seeds.end());
+
+    /*
+    Best ungapped score of at most l bases on a diagonal without a seed
+    match. Every _seed_len consecutive bases there hold a mismatch.
+    */
+    _nonseed_bound.assign(read_len + 1, 0);
+    for (int l = 1; l <= read_len; l++) {
+        int mismatch = l / _seed_len;
+        int score = (l - mismatch) * _match_score + mismatch * _mismatch_score;
+        _nonseed_bound[l] = max(_nonseed_bound[l - 1], score);
+    }
+}
+
+bool BMLSelector::alignUngapped(int c, int &upper) {
+    /*
+    Score candidate c without gaps along the diagonals of its seed
+    matches. Returns true when that score is provably the DP score, with
+    the same end cell. Otherwise upper is set to a bound on the DP score.
+    */
+    const string &ref_seq = _cand_ref[c];
+    int read_len = _read.size();
+    long ref_len = ref_seq.size();
+
+    // Pack the window and collect the diagonals of its seed matches
+    _win_packed.assign(ref_len / 32 + 2, 0);
+    _win_ambiguous.assign(ref_len / 32 + 2, 0);
+    _diagonals.clear();
+    uint64_t seed_mask =
+        _seed_len == 32 ? ~0ULL : (1ULL << (2 * _seed_len)) - 1;
+    uint64_t seed = 0;
+    int valid = 0;
+    for (long j = 0; j < ref_len; j++) {
+        int code = baseCode(ref_seq[j]);
+        if (code < 0) {
+            // Ambiguous bases mismatch every read base
+            _win_ambiguous[j / 32] |= 1ULL << (2 * (j % 32));
+            valid = 0;
+            continue;
+        }
+        _win_packed[j / 32] |= (uint64_t)code << (2 * (j % 32));
+        seed = ((seed << 2) | code) & seed_mask;
+        if (++valid < _seed_len) continue;
+
+        vector<pair<uint64_t, int> >::iterator it = lower_bound(
+            _read_seeds.begin(), _read_seeds.end(), make_pair(seed, 0));
+        for (; it != _read_seeds.end() && it->first == seed; ++it) {
+            _diagonals.push_back(j - _seed_len + 1 - it->second);
+        }
+    }
+    sort(_diagonals.begin(), _diagonals.end());
+    _diagonals.erase(unique(_diagonals.begin(), _diagonals.end()),
+                     _diagonals.end());
+    if (!_diagonals.empty()) {
+        _cand_diag_min[c] = _diagonals.front();
+        _cand_diag_max[c] = _diagonals.back();
+    }
+
+    /*
+    Kadane along each diagonal, 32 bases per XOR. The DP keeps the first
+    cell in row-major order reaching the best score, so does this.
+    */
+    int best = 0;
+    long best_row = 0;
+    long best_col = 0;
+    for (int k = 0; k < _diagonals.size(); k++) {
+        long diag = _diagonals[k];
+        long row_begin = max(0L, -diag);
+        long row_end = min((long)read_len, ref_len - diag);
+        // Column 0 below row 0 has no diagonal predecessor, its M is 0
+        if (diag < 0) row_begin++;
+
+        int score = 0;
+        for (long i = row_begin; i < row_end; i += 32) {
+            int n = min(32L, row_end - i);
+            uint64_t diff = getBits(_read_packed, 2 * i) ^
+                            getBits(_win_packed, 2 * (i + diag));
+            uint64_t mismatch = ((diff | (diff >> 1)) & 0x5555555555555555ULL) |
+                                getBits(_win_ambiguous, 2 * (i + diag));
+            if (n < 32) mismatch &= (1ULL << (2 * n)) - 1;
+
+            int prev = 0;
+            while (true) {
+                int next = mismatch ? __builtin_ctzll(mismatch) / 2 : n;
+                score += (next - prev) * _match_score;
+                long row = i + next - 1;
+                if (next > prev &&
+                    (score > best ||
+                     (score == best &&
+                      (row < best_row ||
+                       (row == best_row && row + diag < best_col))))) {
+                    best = score;
+                    best_row = row;
+                    best_col = row + diag;
+                }
+                if (next == n) break;
+                score = max(0, score + _mismatch_score);
+                prev = next + 1;
+                mismatch &= mismatch - 1;
+            }
+        }
+    }
+
+    /*
+    An alignment with a gap loses at least the gap open score against a
+    full-length match, and one off the seed diagonals is capped by
+    _nonseed_bound. Beating both makes the ungapped score exact.
+    */
+    int gapped_bound = read_len * _match_score + _gap_open_score;
+    int nonseed_bound = _nonseed_bound[min((long)read_len, ref_len)];
+    if (best > gapped_bound && best > nonseed_bound) {
+        _cand_score[c] = best;
+        _cand_end_row[c] = best_row;
+        _cand_end_col[c] = best_col;
+        return true;
+    }
+    // Without seed matches every path, gapped or not, is off the seed
+    // diagonals
+    if (_diagonals.empty())
+        upper = nonseed_bound;
+    else
+        upper = max(best, max(gapped_bound, nonseed_bound));
+    return false;
+}
+
+#ifdef __SSE2__
+void BMLSelector::buildProfile() {
+    int read_len = _read.size();
+    _seg_len = (read_len + SW_LANES - 1) / SW_LANES;
+
+    // One profile for every distinct character of the read
+    memset(_prof_idx, 0, sizeof(_prof_idx));
+    _prof_num = 1;
+    for (int i = 0; i < read_len; i++) {
+        uint8_t c = _read[i];
+        if (_prof_idx[c] == 0) _prof_idx[c] = _prof_num++;
+    }
+
+    if (_prof_num * _seg_len > _profile_cap) {
+        _mm_free(_profile);
+        _profile_cap = _prof_num * _seg_len;
+        _profile =
+            (__m128i *)_mm_malloc(_profile_cap * sizeof(__m128i), 16);
+    }
+    if (_seg_len > _col_cap) {
+        __m128i **cols[] = {&_h_store, &_h_load, &_m_col,   &_d_col,
+                            &_i_col,   &_best,   &_best_col};
+        _col_cap = _seg_len;
+        for (int c = 0; c < 7; c++) {
+            _mm_free(*cols[c]);
+            *cols[c] = (__m128i *)_mm_malloc(_col_cap * sizeof(__m128i), 16);
+        }
+    }
+
+    for (int p = 0; p < _prof_num; p++) {
+        int16_t *prof = (int16_t *)&_profile[p * _seg_len];
+        for (int seg = 0; seg < _seg_len; seg++) {
+            for (int lane = 0; lane < SW_LANES; lane++) {
+                int i = lane * _seg_len + seg;
+                int16_t score;
+                if (i >= read_len)
+                    score = SW_NEG_INF;
+                else if (p != 0 && _prof_idx[(uint8_t)_read[i]] == p)
+                    score = _match_score;
+                else
+                    score = _mismatch_score;
+                prof[seg * SW_LANES + lane] = score;
+            }
+        }
+    }
+}
+#endif
 
+int BMLSelector::align(const string &ref_seq, uint32_t &max_end_row,
+                       uint32_t &max_end_col) {
+#ifdef __SSE2__
+    if (ref_seq.size() <= SW_MAX_REF_LEN)
+        return smith_waterman_striped(ref_seq, max_end_row, max_end_col);
+#endif
+    return smith_waterman(ref_seq, _read, max_end_row, max_end_col);
+}
+
+bool BMLSelector::select(int new_score, uint32_t end_row, uint32_t end_col,
+                         long cml_loc, int strand) {
+    // Returns whether the new score is the best so far
     if (new_score > _max_score) {
-        _map_loc = cml_loc + temp_end_col - temp_end_row;
+        _map_loc = cml_loc + end_col - end_row;
+        _map_strand = strand;
         _max_score = new_score;
+        _map_end_row = end_row;
+        _map_end_col = end_col;
+        return true;
+    }
+    return false;
+}
+
+void BMLSelector::update(const string &ref_seq, long cml_loc) {
+    uint32_t temp_end_row = 0;
+    uint32_t temp_end_col = 0;
+    int new_score = align(ref_seq, temp_end_row, temp_end_col);
+    if (select(new_score, temp_end_row, temp_end_col, cml_loc, _strand))
+        _map_cand = -1;
+}
+
+string &BMLSelector::addCandidate(long cml_loc, int strand) {
+    // Return the buffer the caller fills with the CML window
+    if (_cand_num == _cand_ref.size()) {
+        _cand_ref.push_back(string());
+        _cand_loc.push_back(0);
+        _cand_strand.push_back(FORWARD_STRAND);
+    }
+    _cand_loc[_cand_num] = cml_loc;
+    _cand_strand[_cand_num] = strand;
+    return _cand_ref[_cand_num++];
+}
+
+void BMLSelector::alignCandidates() {
+    /*
+    Align all candidates added since init() and select the best one.
+    The result is the same as calling update() on each of them in order,
+    with the read of their strand. Candidates settled by the ungapped
+    pre-check skip the DP, and so do candidates that cannot beat a
+    settled one.
+    */
+    _cand_score.resize(_cand_num);
+    _cand_end_row.resize(_cand_num);
+    _cand_end_col.resize(_cand_num);
+    _cand_state.assign(_cand_num, CAND_ALIGN);
+    _cand_upper.assign(_cand_num, INT_MAX);
+    _cand_diag_min.assign(_cand_num, 1);
+    _cand_diag_max.assign(_cand_num, 0);
+
+    int c = 0;
+    int settled_max = 0;
+    for (int s = 0; s < STRAND_NUM && _read_packable; s++) {
+        for (c = 0; c < _cand_num; c++) {
+            if (_cand_strand[c] != s) continue;
+            useStrand(s);
+            if (alignUngapped(c, _cand_upper[c])) {
+                _cand_state[c] = CAND_SETTLED;
+                settled_max = max(settled_max, _cand_score[c]);
+            }
+        }
+    }
+
+    // A hopeless candidate either loses to a settled one or ties with
+    // an earlier one, select() keeps the first of equal scores
+    int prefix_max = 0;
+    for (c = 0; c < _cand_num; c++) {
+        if (_cand_state[c] == CAND_SETTLED) {
+            prefix_max = max(prefix_max, _cand_score[c]);
+        }
+        else if (_cand_upper[c] < settled_max ||
+                 _cand_upper[c] <= prefix_max) {
+            _cand_state[c] = CAND_HOPELESS;
+            _cand_score[c] = 0;
+            _cand_end_row[c] = 0;
+            _cand_end_col[c] = 0;
+        }
+    }
+
+    _cand_todo.clear();
+    for (c = 0; c < _cand_num; c++) {
+        if (_cand_state[c] == CAND_ALIGN) _cand_todo.push_back(c);
+    }
+    if (_cand_num > 0) {
+        if (_cand_todo.empty()) {
+            _ungapped_read_cnt++;
+        }
+        else {
+            _gapped_read_cnt++;
+        }
+    }
+
+    // The rest goes through the DP, starting with the strand in use
+    int first_strand = _strand;
+    for (int k = 0; k < STRAND_NUM; k++) {
+        int s = (first_strand + k) % STRAND_NUM;
+        _cand_list.clear();
+        for (int t = 0; t < _cand_todo.size(); t++) {
+            if (_cand_strand[_cand_todo[t]] == s)
+                _cand_list.push_back(_cand_todo[t]);
+        }
+        if (_cand_list.empty()) continue;
+        useStrand(s);
+        alignList(_cand_list);
+    }
+
+    for (c = 0; c < _cand_num; c++) {
+        if (select(_cand_score[c], _cand_end_row[c], _cand_end_col[c],
+                   _cand_loc[c], _cand_strand[c]))
+            _map_cand = c;
+    }
+}
+
+void BMLSelector::alignList(const vector<int> &cands) {
+    // Align the listed candidates with the read in use
+    int c;
+    int read_len = _read.size();
+    _cand_banded.clear();
+    _cand_full.clear();
+    for (int t = 0; t < cands.size(); t++) {
+        c = cands[t];
+#ifdef __SSE2__
+        // Band the windows with seed matches when it saves most cells
+        long ref_len = _cand_ref[c].size();
+        long band = _cand_diag_max[c] - _cand_diag_min[c] + 2 * _band_width + 1;
+        if (_band_width > 0 && _cand_diag_min[c] <= _cand_diag_max[c] &&
+            ref_len <= SW_MAX_REF_LEN && read_len + band <= SW_MAX_REF_LEN &&
+            2 * band <= ref_len) {
+            _cand_banded.push_back(c);
+            continue;
+        }
+#endif
+        _cand_full.push_back(c);
+    }
+
+#ifdef __SSE2__
+    // Lanes of a batch share the widest band, so batch similar bands
+    for (int t = 1; t < _cand_banded.size(); t++) {
+        int cur = _cand_banded[t];
+        long band = _cand_diag_max[cur] - _cand_diag_min[cur];
+        int u = t;
+        for (; u > 0; u--) {
+            int prev = _cand_banded[u - 1];
+            if (_cand_diag_max[prev] - _cand_diag_min[prev] <= band) break;
+            _cand_banded[u] = prev;
+        }
+        _cand_banded[u] = cur;
+    }
+    // Windows the band cannot settle are added to _cand_full
+    for (int t = 0; t < _cand_banded.size(); t += _batch_lanes) {
+        smith_waterman_banded(&_cand_banded[t],
+                              min(_batch_lanes, (int)_cand_banded.size() - t));
+    }
+#endif
+
+    int t = 0;
+    int full_num = _cand_full.size();
+    _full_cand_cnt += full_num;
+    for (t = 0; t < full_num; t++) {
+        _dp_cell_cnt += read_len * (long)_cand_ref[_cand_full[t]].size();
+    }
+    t = 0;
+#ifdef __SSE2__
+    // One candidate window per vector lane
+    while (full_num - t >= _batch_min_cand) {
+        int num = min(_batch_lanes, full_num - t);
+        smith_waterman_batch(&_cand_full[t], num);
+        t += num;
+    }
+#endif
+    for (; t < full_num; t++) {
+        c = _cand_full[t];
+        _cand_end_row[c] = 0;
+        _cand_end_col[c] = 0;
+        _cand_score[c] = align(_cand_ref[c], _cand_end_row[c], _cand_end_col[c]);
     }
 }
 
@@ -145,4 +707,540 @@ int BMLSelector::smith_waterman(const string &ref_seq, const string &read,
     return max_score;
 }
 
-long BMLSelector::getMapLoc() { return _map_loc; }
\ No newline at end of file
+int BMLSelector::smith_waterman_striped(const string &ref_seq,
+                                        uint32_t &max_end_row,
+                                        uint32_t &max_end_col) {
+    /*
+    Farrar's striped Smith-Waterman over the read set by setRead().
+    Computes the same recurrences as smith_waterman() with 16-bit
+    saturating lanes and reports the same best score and end position
+    (the first cell in row-major order reaching the best score).
+
+    Per reference column j, for every read row i:
+    M = max(0, max(M, I, D) of (i-1, j-1) + score)
+    I = max(0, M of (i-1, j) + gap_open, I of (i-1, j) + gap_extend)
+    D = max(0, M of (i, j-1) + gap_open, D of (i, j-1) + gap_extend)
+    */
+#ifdef __SSE2__
+    int read_len = _read.size();
+    int ref_len = ref_seq.size();
+    if (read_len == 0 || ref_len == 0) return 0;
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i gap_open = _mm_set1_epi16(_gap_open_score);
+    const __m128i gap_ext = _mm_set1_epi16(_gap_extend_score);
+
+    // Column -1 can only be entered through row -1
+    for (int seg = 0; seg < _seg_len; seg++) {
+        _h_load[seg] = _mm_set1_epi16(SW_NEG_INF);
+        _m_col[seg] = zero;
+        _d_col[seg] = zero;
+        _best[seg] = zero;
+        _best_col[seg] = zero;
+    }
+
+    for (int j = 0; j < ref_len; j++) {
+        const __m128i *prof =
+            &_profile[_prof_idx[(uint8_t)ref_seq[j]] * _seg_len];
+        const __m128i col = _mm_set1_epi16(j);
+
+        // H of the previous column one row up, row -1 is 0
+        __m128i h_diag = _mm_slli_si128(_h_load[_seg_len - 1], 2);
+
+        // M and I of the previous row. Across lanes they are not known
+        // yet, so start from 0 and fix it up below.
+        __m128i m_up = zero;
+        __m128i i_up = zero;
+
+        for (int seg = 0; seg < _seg_len; seg++) {
+            __m128i m = _mm_max_epi16(_mm_adds_epi16(h_diag, prof[seg]), zero);
+            __m128i d = _mm_max_epi16(
+                _mm_max_epi16(_mm_adds_epi16(_m_col[seg], gap_open),
+                              _mm_adds_epi16(_d_col[seg], gap_ext)),
+                zero);
+            __m128i i = _mm_max_epi16(
+                _mm_max_epi16(_mm_adds_epi16(m_up, gap_open),
+                              _mm_adds_epi16(i_up, gap_ext)),
+                zero);
+            __m128i h = _mm_max_epi16(m, _mm_max_epi16(i, d));
+
+            h_diag = _h_load[seg];
+            _m_col[seg] = m;
+            _d_col[seg] = d;
+            _i_col[seg] = i;
+            _h_store[seg] = h;
+
+            __m128i gt = _mm_cmpgt_epi16(h, _best[seg]);
+            _best[seg] = _mm_max_epi16(h, _best[seg]);
+            _best_col[seg] = _mm_or_si128(_mm_and_si128(gt, col),
+                                          _mm_andnot_si128(gt, _best_col[seg]));
+
+            m_up = m;
+            i_up = i;
+        }
+
+        // Lazy-F loop: carry I from the last row of each lane into the
+        // first row of the next lane until nothing improves.
+        __m128i carry = _mm_slli_si128(
+            _mm_max_epi16(_mm_adds_epi16(m_up, gap_open),
+                          _mm_adds_epi16(i_up, gap_ext)),
+            2);
+        int seg = 0;
+        while (_mm_movemask_epi8(_mm_cmpgt_epi16(carry, _i_col[seg])) != 0) {
+            _i_col[seg] = _mm_max_epi16(_i_col[seg], carry);
+            __m128i h = _mm_max_epi16(_h_store[seg], _i_col[seg]);
+            _h_store[seg] = h;
+
+            __m128i gt = _mm_cmpgt_epi16(h, _best[seg]);
+            _best[seg] = _mm_max_epi16(h, _best[seg]);
+            _best_col[seg] = _mm_or_si128(_mm_and_si128(gt, col),
+                                          _mm_andnot_si128(gt, _best_col[seg]));
+
+            carry = _mm_adds_epi16(carry, gap_ext);
+            seg += 1;
+            if (seg == _seg_len) {
+                carry = _mm_slli_si128(carry, 2);
+                seg = 0;
+            }
+        }
+
+        __m128i *tmp = _h_load;
+        _h_load = _h_store;
+        _h_store = tmp;
+    }
+
+    // The first row reaching the best score wins, then its first column
+    int16_t *best = (int16_t *)_best;
+    int16_t *best_col = (int16_t *)_best_col;
+    int max_score = 0;
+    for (int i = 0; i < read_len; i++) {
+        int idx = (i % _seg_len) * SW_LANES + i / _seg_len;
+        if (best[idx] > max_score) {
+            max_score = best[idx];
+            max_end_row = i;
+            max_end_col = best_col[idx];
+        }
+    }
+    return max_score;
+#else
+    return smith_waterman(ref_seq, _read, max_end_row, max_end_col);
+#endif
+}
+
+#ifdef __SSE2__
+template <typename V>
+inline __attribute__((always_inline)) void BMLSelector::batchKernel(
+    const int *cand, int num) {
+    /*
+    Inter-sequence Smith-Waterman: align the read against the num
+    candidates listed in cand at once, one window per 16-bit lane. Each lane
+    runs the same row-major DP as smith_waterman(), so it reports the
+    same score and end position. Windows too long for 16-bit column
+    indices are aligned on their own.
+    */
+    const int lanes = sizeof(V) / sizeof(int16_t);
+    int read_len = _read.size();
+    int max_len = 0;
+    int16_t lens[BATCH_MAX_LANES] = {0};
+    for (int k = 0; k < num; k++) {
+        int len = _cand_ref[cand[k]].size();
+        if (len > SW_MAX_REF_LEN || read_len > SW_MAX_REF_LEN) {
+            _cand_end_row[cand[k]] = 0;
+            _cand_end_col[cand[k]] = 0;
+            _cand_score[cand[k]] =
+                smith_waterman(_cand_ref[cand[k]], _read,
+                               _cand_end_row[cand[k]],
+                               _cand_end_col[cand[k]]);
+            continue;
+        }
+        lens[k] = len;
+        max_len = max(max_len, len);
+    }
+
+    // Transpose the windows, column j of all lanes is contiguous.
+    // Lanes past the end of their window hold 0, which matches no base.
+    _batch_ref.assign(max_len * lanes, 0);
+    for (int k = 0; k < num; k++) {
+        const string &ref_seq = _cand_ref[cand[k]];
+        for (int j = 0; j < lens[k]; j++) {
+            _batch_ref[j * lanes + k] = (uint8_t)ref_seq[j];
+        }
+    }
+    _batch_m.assign(max_len * lanes, 0);
+    _batch_i.assign(max_len * lanes, 0);
+    _batch_h.assign(max_len * lanes, 0);
+
+    const V zero = bvSet<V>(0);
+    const V neg_inf = bvSet<V>(SW_NEG_INF);
+    const V match = bvSet<V>(_match_score);
+    const V mismatch = bvSet<V>(_mismatch_score);
+    const V gap_open = bvSet<V>(_gap_open_score);
+    const V gap_ext = bvSet<V>(_gap_extend_score);
+    const V len_vec = bvLoad<V>(lens);
+
+    V best = zero;
+    V best_row = zero;
+    V best_col = zero;
+
+    for (int i = 0; i < read_len; i++) {
+        const V base = bvSet<V>((uint8_t)_read[i]);
+        const V row = bvSet<V>(i);
+
+        // Column -1 is only reachable from row -1
+        V h_diag = i == 0 ? zero : neg_inf;
+        V m_left = zero;
+        V d_left = zero;
+
+        for (int j = 0; j < max_len; j++) {
+            int16_t *m_ptr = &_batch_m[j * lanes];
+            int16_t *i_ptr = &_batch_i[j * lanes];
+            int16_t *h_ptr = &_batch_h[j * lanes];
+
+            V eq = bvEq(bvLoad<V>(&_batch_ref[j * lanes]), base);
+            V score = bvBlend(eq, match, mismatch);
+
+            V m = bvMax(bvAdds(h_diag, score), zero);
+            V ins = bvMax(bvMax(bvAdds(bvLoad<V>(m_ptr), gap_open),
+                                        bvAdds(bvLoad<V>(i_ptr), gap_ext)),
+                                  zero);
+            V del = bvMax(
+                bvMax(bvAdds(m_left, gap_open), bvAdds(d_left, gap_ext)), zero);
+            V h = bvMax(m, bvMax(ins, del));
+
+            h_diag = bvLoad<V>(h_ptr);
+            bvStore(m_ptr, m);
+            bvStore(i_ptr, ins);
+            bvStore(h_ptr, h);
+            m_left = m;
+            d_left = del;
+
+            // Strictly better cells inside the window move the best
+            V col = bvSet<V>(j);
+            V gt = bvAnd(bvGt(h, best), bvGt(len_vec, col));
+            best = bvBlend(gt, h, best);
+            best_row = bvBlend(gt, row, best_row);
+            best_col = bvBlend(gt, col, best_col);
+        }
+    }
+
+    int16_t best_arr[BATCH_MAX_LANES];
+    int16_t best_row_arr[BATCH_MAX_LANES];
+    int16_t best_col_arr[BATCH_MAX_LANES];
+    bvStore(best_arr, best);
+    bvStore(best_row_arr, best_row);
+    bvStore(best_col_arr, best_col);
+    for (int k = 0; k < num; k++) {
+        if (lens[k] == 0 && !_cand_ref[cand[k]].empty()) continue;
+        _cand_score[cand[k]] = best_arr[k];
+        _cand_end_row[cand[k]] = best_row_arr[k];
+        _cand_end_col[cand[k]] = best_col_arr[k];
+    }
+}
+
+template <typename V>
+inline __attribute__((always_inline)) void BMLSelector::bandedKernel(
+    const int *cand, int num) {
+    /*
+    Banded inter-sequence Smith-Waterman, one window per 16-bit lane.
+    Cells outside the band score 0, so a lane finds the best path that
+    stays in its band. A path leaving the band either holds a gap longer
+    than _band_width or has no cell on a seed diagonal. When the banded
+    score beats both bounds it is the score of smith_waterman(), with the
+    same end cell. Other windows are queued in _cand_full.
+    */
+    const int lanes = sizeof(V) / sizeof(int16_t);
+    int read_len = _read.size();
+    int width = 0;
+    int16_t lens[BATCH_MAX_LANES] = {0};
+    int16_t lows[BATCH_MAX_LANES] = {0};
+    for (int k = 0; k < num; k++) {
+        int c = cand[k];
+        lens[k] = _cand_ref[c].size();
+        lows[k] = _cand_diag_min[c] - _band_width;
+        width = max(width, (int)(_cand_diag_max[c] + _band_width - lows[k] + 1));
+    }
+
+    // Transpose the windows by band column: row i, band column b reads
+    // entry i + b, holding window column i + b + low of every lane.
+    int ref_cols = read_len + width;
+    _batch_ref.assign(ref_cols * lanes, 0);
+    for (int k = 0; k < num; k++) {
+        const string &ref_seq = _cand_ref[cand[k]];
+        for (int x = 0; x < ref_cols; x++) {
+            int j = x + lows[k];
+            if (j >= 0 && j < lens[k]) {
+                _batch_ref[x * lanes + k] = (uint8_t)ref_seq[j];
+            }
+        }
+    }
+    // Band column width is above the band and stays 0
+    _batch_m.assign((width + 1) * lanes, 0);
+    _batch_i.assign((width + 1) * lanes, 0);
+    _batch_h.assign(width * lanes, 0);
+
+    const V zero = bvSet<V>(0);
+    const V neg_inf = bvSet<V>(SW_NEG_INF);
+    const V match = bvSet<V>(_match_score);
+    const V mismatch = bvSet<V>(_mismatch_score);
+    const V gap_open = bvSet<V>(_gap_open_score);
+    const V gap_ext = bvSet<V>(_gap_extend_score);
+    const V len_vec = bvLoad<V>(lens);
+    const V low_vec = bvLoad<V>(lows);
+
+    V best = zero;
+    V best_row = zero;
+    V best_band_col = zero;
+
+    for (int i = 0; i < read_len; i++) {
+        const V base = bvSet<V>((uint8_t)_read[i]);
+        const V row = bvSet<V>(i);
+
+        // Band column -1 is outside the band
+        V m_left = zero;
+        V d_left = zero;
+
+        // Band columns b and b + 1 of the buffers still hold row i - 1
+        for (int b = 0; b < width; b++) {
+            int16_t *m_ptr = &_batch_m[b * lanes];
+            int16_t *i_ptr = &_batch_i[b * lanes];
+            int16_t *h_ptr = &_batch_h[b * lanes];
+
+            V col = bvAdds(bvSet<V>(i + b), low_vec);
+            V eq =
+                bvEq(bvLoad<V>(&_batch_ref[(i + b) * lanes]), base);
+            V score = bvBlend(eq, match, mismatch);
+
+            V m = bvMax(bvAdds(bvLoad<V>(h_ptr), score), zero);
+            V ins =
+                bvMax(bvMax(bvAdds(bvLoad<V>(m_ptr + lanes), gap_open),
+                            bvAdds(bvLoad<V>(i_ptr + lanes), gap_ext)),
+                      zero);
+            V del = bvMax(
+                bvMax(bvAdds(m_left, gap_open), bvAdds(d_left, gap_ext)), zero);
+            V h = bvMax(m, bvMax(ins, del));
+
+            // Left of the window, like column -1 of smith_waterman()
+            V before = bvGt(zero, col);
+            m = bvBlend(before, zero, m);
+            ins = bvBlend(before, zero, ins);
+            del = bvBlend(before, zero, del);
+            h = bvBlend(before, neg_inf, h);
+
+            bvStore(m_ptr, m);
+            bvStore(i_ptr, ins);
+            bvStore(h_ptr, h);
+            m_left = m;
+            d_left = del;
+
+            // Strictly better cells inside the window move the best
+            V gt = bvAnd(bvGt(h, best), bvGt(len_vec, col));
+            best = bvBlend(gt, h, best);
+            best_row = bvBlend(gt, row, best_row);
+            best_band_col = bvBlend(gt, bvSet<V>(b), best_band_col);
+        }
+    }
+
+    int16_t best_arr[BATCH_MAX_LANES];
+    int16_t best_row_arr[BATCH_MAX_LANES];
+    int16_t best_band_col_arr[BATCH_MAX_LANES];
+    bvStore(best_arr, best);
+    bvStore(best_row_arr, best_row);
+    bvStore(best_band_col_arr, best_band_col);
+
+    int gapped_bound = read_len * _match_score + _gap_open_score +
+                       _band_width * _gap_extend_score;
+    for (int k = 0; k < num; k++) {
+        int c = cand[k];
+        int nonseed_bound = _nonseed_bound[min(read_len, (int)lens[k])];
+        _dp_cell_cnt += read_len * width;
+        if (best_arr[k] > gapped_bound && best_arr[k] > nonseed_bound) {
+            _cand_score[c] = best_arr[k];
+            _cand_end_row[c] = best_row_arr[k];
+            _cand_end_col[c] =
+                best_row_arr[k] + best_band_col_arr[k] + lows[k];
+            _banded_cand_cnt++;
+        }
+        else {
+            _cand_full.push_back(c);
+        }
+    }
+}
+
+void BMLSelector::smith_waterman_batch(const int *cand, int num) {
+    if (_batch_lanes == 16)
+        smith_waterman_batch_avx2(cand, num);
+    else
+        batchKernel<__m128i>(cand, num);
+}
+
+TARGET_AVX2 void BMLSelector::smith_waterman_batch_avx2(const int *cand,
+                                                        int num) {
+    batchKernel<__m256i>(cand, num);
+}
+
+void BMLSelector::smith_waterman_banded(const int *cand, int num) {
+    if (_batch_lanes == 16)
+        smith_waterman_banded_avx2(cand, num);
+    else
+        bandedKernel<__m128i>(cand, num);
+}
+
+TARGET_AVX2 void BMLSelector::smith_waterman_banded_avx2(const int *cand,
+                                                         int num) {
+    bandedKernel<__m256i>(cand, num);
+}
+#endif
+
+int BMLSelector::fillTrace(const string &ref_seq, long diag_lo,
+                           long diag_hi) {
+    /*
+    The recurrences of smith_waterman() up to the winning end cell, on
+    the diagonals j - i in [diag_lo, diag_hi] only. Cells outside the
+    band score 0, as if the alignment started over there, so every path
+    through the band is a valid alignment of its own score. Returns the
+    score of the end cell.
+    */
+    int rows = _map_end_row + 1;
+    long width = diag_hi - diag_lo + 1;
+    _trace_m.assign(rows * width, 0);
+    _trace_i.assign(rows * width, 0);
+    _trace_d.assign(rows * width, 0);
+    for (int i = 0; i < rows; i++) {
+        long j_begin = max(0L, i + diag_lo);
+        long j_end = min((long)_map_end_col, i + diag_hi);
+        for (long j = j_begin; j <= j_end; j++) {
+            long k = i * width + j - i - diag_lo;
+
+            // The diagonal cell is in the band whenever this one is,
+            // the cell above and the cell left may not be
+            int diag = 0;
+            if (i == 0) {
+                diag = 0;
+            }
+            else if (j == 0) {
+                diag = SW_NEG_INF;
+            }
+            else {
+                long p = k - width;
+                diag = max(_trace_m[p], max(_trace_i[p], _trace_d[p]));
+            }
+            int score = ref_seq[j] == _read[i] ? _match_score : _mismatch_score;
+            _trace_m[k] = max(0, diag + score);
+
+            if (i > 0 && j - (i - 1) <= diag_hi) {
+                long up = k - width + 1;
+                _trace_i[k] = max(0, max(_trace_m[up] + _gap_open_score,
+                                         _trace_i[up] + _gap_extend_score));
+            }
+            if (j > 0 && j - 1 - i >= diag_lo) {
+                _trace_d[k] = max(0, max(_trace_m[k - 1] + _gap_open_score,
+                                         _trace_d[k - 1] + _gap_extend_score));
+            }
+        }
+    }
+    return _trace_m[_map_end_row * width + _map_end_col - _map_end_row -
+                    diag_lo];
+}
+
+bool BMLSelector::traceAlignment(Alignment &aln) {
+    /*
+    Trace back the alignment of the winning candidate of the last
+    alignCandidates(), the only window that gets a CIGAR. The DP is
+    redone on the winning diagonal alone, which is enough for ungapped
+    alignments, then in a band around it, then over the whole window,
+    until it finds the best score. Returns false if no candidate aligned.
+    */
+    if (_map_cand < 0 || _max_score <= 0) return false;
+    const string &ref_seq = _cand_ref[_map_cand];
+    useStrand(_map_strand);
+
+    long end_diag = (long)_map_end_col - _map_end_row;
+    int half = max(_band_width, 16);
+    long diag_lo = end_diag;
+    long diag_hi = end_diag;
+    if (fillTrace(ref_seq, diag_lo, diag_hi) != _max_score) {
+        diag_lo = end_diag - half;
+        diag_hi = end_diag + half;
+        if (fillTrace(ref_seq, diag_lo, diag_hi) != _max_score) {
+            diag_lo = -(long)_map_end_row;
+            diag_hi = _map_end_col;
+            fillTrace(ref_seq, diag_lo, diag_hi);
+        }
+    }
+    long width = diag_hi - diag_lo + 1;
+
+    // Walk back from the end cell, preferring M, then I, then D on ties
+    // like the forward pass does
+    string ops;
+    int match_num = 0;
+    int state = 0;
+    long i = _map_end_row;
+    long j = _map_end_col;
+    while (true) {
+        long k = i * width + j - i - diag_lo;
+        if (state == 0) {
+            ops += 'M';
+            if (ref_seq[j] == _read[i]) match_num++;
+            if (i == 0 || j == 0) break;
+            long p = k - width;
+            int diag = max(_trace_m[p], max(_trace_i[p], _trace_d[p]));
+            if (diag <= 0) break;
+            if (_trace_m[p] == diag)
+                state = 0;
+            else if (_trace_i[p] == diag)
+                state = 1;
+            else
+                state = 2;
+            i--;
+            j--;
+        }
+        else if (state == 1) {
+            // Read base against a gap, from the row above
+            ops += 'I';
+            long up = k - width + 1;
+            state = _trace_i[k] == _trace_m[up] + _gap_open_score ? 0 : 1;
+            i--;
+        }
+        else {
+            // Reference base against a gap, from the column on the left
+            ops += 'D';
+            state = _trace_d[k] == _trace_m[k - 1] + _gap_open_score ? 0 : 2;
+            j--;
+        }
+    }
+
+    // Run-length encode the operations, which were collected backwards
+    aln.cigar.clear();
+    for (long e = ops.size(); e > 0;) {
+        long b = e - 1;
+        while (b > 0 && ops[b - 1] == ops[e - 1]) b--;
+        aln.cigar += to_string(e - b);
+        aln.cigar += ops[e - 1];
+        e = b;
+    }
+    long cml_loc = _cand_loc[_map_cand];
+    aln.ref_begin = cml_loc + j;
+    aln.ref_end = cml_loc + _map_end_col + 1;
+    aln.read_begin = i;
+    aln.read_end = _map_end_row + 1;
+    aln.strand = _map_strand;
+    aln.score = _max_score;
+    aln.match_num = match_num;
+    return true;
+}
+
+int BMLSelector::getMaxScore() { return _max_score; }
+
+long BMLSelector::getMapLoc() { return _map_loc; }
+
+int BMLSelector::getMapStrand() { return _map_strand; }
+
+long BMLSelector::getUngappedReadCnt() { return _ungapped_read_cnt; }
+
+long BMLSelector::getGappedReadCnt() { return _gapped_read_cnt; }
+
+long BMLSelector::getBandedCandCnt() { return _banded_cand_cnt; }
+
+long BMLSelector::getFullCandCnt() { return _full_cand_cnt; }
+
+long BMLSelector::getDPCellCnt() { return _dp_cell_cnt; }
\ No newline at end of file
@@ -1,10 +1,38 @@
+#include <cstdint>
 #include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "cpu_features.h"
 
 using namespace std;
 
 #ifndef __BML_SELECTOR__
 #define __BML_SELECTOR__
 
+// Strand of a CML. Reverse CMLs are aligned with the reverse complement of
+// the read.
+#define FORWARD_STRAND 0
+#define REVERSE_STRAND 1
+#define STRAND_NUM 2
+
+// Local alignment of the read with the best candidate. Read coordinates
+// are on the read of the strand, the CIGAR has M, I and D operations only.
+struct Alignment {
+    long ref_begin;
+    long ref_end;
+    int read_begin;
+    int read_end;
+    int strand;
+    int score;
+    int match_num;
+    string cigar;
+};
+
 class BMLSelector {
    private:
     // Score setting
@@ -16,14 +44,143 @@ class BMLSelector {
     // Current max score
     int _max_score;
     long _map_loc;
+    int _map_strand;
+
+    // Candidate holding the max score and its end cell, -1 if none
+    int _map_cand;
+    uint32_t _map_end_row;
+    uint32_t _map_end_col;
+
+    // DP of traceAlignment() in the band of the winning diagonal, one
+    // band row per read row
+    vector<int> _trace_m;
+    vector<int> _trace_i;
+    vector<int> _trace_d;
+
+    // Read of each strand, and the one in use
+    string _strand_read[STRAND_NUM];
+    int _strand;
+    string _read;
+
+    // CML windows of the read, aligned together by alignCandidates()
+    int _cand_num;
+    vector<string> _cand_ref;
+    vector<long> _cand_loc;
+    vector<int> _cand_strand;
+    vector<int> _cand_score;
+    vector<uint32_t> _cand_end_row;
+    vector<uint32_t> _cand_end_col;
+
+    // Transposed windows and DP rows of one candidate batch, the windows
+    // per batch, 16 with AVX2 and 8 with SSE2, and the fewest windows
+    // worth a batch
+    int _batch_lanes;
+    int _batch_min_cand;
+    vector<int16_t> _batch_ref;
+    vector<int16_t> _batch_m;
+    vector<int16_t> _batch_i;
+    vector<int16_t> _batch_h;
+
+    /*
+    Ungapped pre-check. Exact seed matches between the read and a window
+    give the diagonals worth scoring without gaps. Packed sequences hold
+    2 bits per base, base i at bits 2 * (i % 32) of word i / 32.
+    */
+    int _seed_len;
+    bool _read_packable;
+    vector<uint64_t> _read_packed;
+    vector<pair<uint64_t, int> > _read_seeds;
+    vector<int> _nonseed_bound;
+    vector<uint64_t> _win_packed;
+    vector<uint64_t> _win_ambiguous;
+    vector<long> _diagonals;
+    vector<int> _cand_state;
+    vector<int> _cand_upper;
+    vector<int> _cand_todo;
+    vector<int> _cand_list;
+
+    /*
+    Banded DP. The band of a window covers its seed match diagonals and
+    _band_width diagonals on either side. Window column j of row i is
+    band column j - i - diagonal of the band's lower edge.
+    */
+    int _band_width;
+    vector<long> _cand_diag_min;
+    vector<long> _cand_diag_max;
+    vector<int> _cand_banded;
+    vector<int> _cand_full;
+
+    // Reads settled by the pre-check alone, and reads that needed the DP
+    long _ungapped_read_cnt;
+    long _gapped_read_cnt;
+
+    // Windows aligned in their band or over the whole matrix, DP cells
+    long _banded_cand_cnt;
+    long _full_cand_cnt;
+    long _dp_cell_cnt;
+
+#ifdef __SSE2__
+    /*
+    Striped query profile of the read, built once per read.
+    Row i of the read is in lane i / _seg_len of segment i % _seg_len.
+    Profile p holds the score of every row against reference character c
+    with _prof_idx[c] == p. Profile 0 is for characters not in the read.
+    */
+    int _seg_len;
+    int _prof_num;
+    int8_t _prof_idx[256];
+    __m128i* _profile;
+    int _profile_cap;
+
+    // Striped DP columns
+    __m128i* _h_store;
+    __m128i* _h_load;
+    __m128i* _m_col;
+    __m128i* _d_col;
+    __m128i* _i_col;
+    __m128i* _best;
+    __m128i* _best_col;
+    int _col_cap;
+
+    void buildProfile();
+    void smith_waterman_batch(const int *, int);
+    void smith_waterman_banded(const int *, int);
+    TARGET_AVX2 void smith_waterman_batch_avx2(const int *, int);
+    TARGET_AVX2 void smith_waterman_banded_avx2(const int *, int);
+    template <typename V>
+    inline __attribute__((always_inline)) void batchKernel(const int *, int);
+    template <typename V>
+    inline __attribute__((always_inline)) void bandedKernel(const int *, int);
+#endif
+
+    void useStrand(int);
+    void buildSeeds();
+    bool alignUngapped(int, int &);
+    void alignList(const vector<int> &);
+    int align(const string &, uint32_t &, uint32_t &);
+    bool select(int, uint32_t, uint32_t, long, int);
+    int fillTrace(const string &, long, long);
 
    public:
-    BMLSelector();
+    BMLSelector(int);
     ~BMLSelector();
+    void setBandWidth(int);
     void init();
-    void update(const string &, const string &, long);
+    void setRead(const string &);
+    void update(const string &, long);
+    string &addCandidate(long, int);
+    void alignCandidates();
     int smith_waterman(const string &, const string &, uint32_t &, uint32_t &);
+    int smith_waterman_striped(const string &, uint32_t &, uint32_t &);
+    int getMaxScore();
     long getMapLoc();
+    int getMapStrand();
+    bool traceAlignment(Alignment &);
+    long getUngappedReadCnt();
+    long getGappedReadCnt();
+    long getBandedCandCnt();
+    long getFullCandCnt();
+    long getDPCellCnt();
 };
 
 #endif
@@ -0,0 +1,224 @@
+#include <cctype>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+#include "bml_selector.h"
+#include "packed_ref_seq.h"
+
+/*
+Check the SIMD alignment paths of BMLSelector against the scalar
+smith_waterman() on random reads and windows. Windows hold copies of the
+read with mismatches, insertions, deletions and N bases, so the ungapped
+pre-check, the banded and the batch kernels all get windows to align.
+
+The batch kernels use the lane width picked for this CPU, 16 windows with
+AVX2 and 8 with SSE2. All lanes are 16-bit.
+*/
+
+static const char bases[] = "ACGTN";
+
+static string randomSeq(mt19937& rng, int len, int base_num) {
+    string seq(len, 'A');
+    for (int i = 0; i < len; i++) {
+        seq[i] = bases[rng() % base_num];
+    }
+    return seq;
+}
+
+static string randomWindow(mt19937& rng, const string& read) {
+    // Most windows are as long as a CML window, some are shorter or longer
+    int len = rng() % 4 == 0 ? 1 + rng() % 700 : 512;
+    string ref = randomSeq(rng, len, rng() % 3 ? 4 : 5);
+
+    // Paste up to two copies of the read, each with its own edits
+    int copy_num = rng() % 3;
+    int read_len = read.size();
+    for (int k = 0; k < copy_num && len > read_len; k++) {
+        int j = rng() % (len - read_len + 1);
+        int error_rate = 5 + rng() % 30;
+        bool indels = rng() % 2;
+        for (int i = 0; i < read_len && j < len; i++) {
+            if (indels && rng() % 40 == 0) {
+                // Deletion from the read, or insertion into it
+                if (rng() % 2) j++;
+                continue;
+            }
+            ref[j++] = rng() % error_rate == 0 ? bases[rng() % 5] : read[i];
+        }
+    }
+    return ref;
+}
+
+static long testStriped(mt19937& rng, int round_num) {
+    // Score and end position of the striped kernel
+    long fail_cnt = 0;
+    BMLSelector sel(20);
+    for (int r = 0; r < round_num; r++) {
+        string read = randomSeq(rng, 20 + rng() % 280, r % 10 ? 4 : 5);
+        string ref = randomWindow(rng, read);
+        sel.init();
+        sel.setRead(read);
+
+        uint32_t row = 0, col = 0, striped_row = 0, striped_col = 0;
+        int score = sel.smith_waterman(ref, read, row, col);
+        int striped_score = sel.smith_waterman_striped(ref, striped_row,
+                                                       striped_col);
+        if (score != striped_score || row != striped_row ||
+            col != striped_col) {
+            cerr << "[testStriped] Round " << r << ": score " << score << " ("
+                 << row << ", " << col << "), striped " << striped_score
+                 << " (" << striped_row << ", " << striped_col << ")" << endl;
+            fail_cnt++;
+        }
+    }
+    return fail_cnt;
+}
+
+static long testCandidates(mt19937& rng, int round_num, long& banded_cnt,
+                           long& full_cnt) {
+    /*
+    Best window of alignCandidates(), which goes through the ungapped
+    pre-check, the banded and the batch kernels, against the scalar
+    kernel applied to every window in order.
+    */
+    long fail_cnt = 0;
+    for (int r = 0; r < round_num; r++) {
+        int seed_len = 4 + rng() % 29;
+        BMLSelector sel(seed_len);
+        sel.setBandWidth(rng() % 20);
+
+        string read = randomSeq(rng, 20 + rng() % 130, r % 50 ? 4 : 5);
+        string strand_read[STRAND_NUM] = {read, ""};
+        reverseComplement(read, strand_read[REVERSE_STRAND]);
+        sel.init();
+        sel.setRead(read);
+
+        int best_score = 0;
+        long best_loc = 0;
+        int best_strand = FORWARD_STRAND;
+        int cand_num = 1 + rng() % 40;
+        for (int c = 0; c < cand_num; c++) {
+            int strand = rng() % 2;
+            long cml_loc = rng() % 100000;
+            string ref = randomWindow(rng, strand_read[strand]);
+            sel.addCandidate(cml_loc, strand) = ref;
+
+            uint32_t row = 0, col = 0;
+            int score = sel.smith_waterman(ref, strand_read[strand], row, col);
+            if (score > best_score) {
+                best_score = score;
+                best_loc = cml_loc + col - row;
+                best_strand = strand;
+            }
+        }
+        sel.alignCandidates();
+
+        if (sel.getMaxScore() != best_score || sel.getMapLoc() != best_loc ||
+            sel.getMapStrand() != best_strand) {
+            cerr << "[testCandidates] Round " << r << ": score " << best_score
+                 << " at " << best_loc << " strand " << best_strand
+                 << ", selected " << sel.getMaxScore() << " at "
+                 << sel.getMapLoc() << " strand " << sel.getMapStrand()
+                 << endl;
+            fail_cnt++;
+        }
+        banded_cnt += sel.getBandedCandCnt();
+        full_cnt += sel.getFullCandCnt();
+    }
+    return fail_cnt;
+}
+
+static int scoreCigar(const Alignment& aln, const string& ref,
+                      long ref_offset, const string& read) {
+    // Score of the CIGAR of aln, -1000 if it does not fit its spans
+    int score = 0;
+    long j = aln.ref_begin - ref_offset;
+    int i = aln.read_begin;
+    for (int p = 0; p < aln.cigar.size();) {
+        int len = 0;
+        while (isdigit(aln.cigar[p])) len = len * 10 + aln.cigar[p++] - '0';
+        char op = aln.cigar[p++];
+        for (int k = 0; k < len; k++) {
+            if (op == 'M') {
+                score += ref[j++] == read[i++] ? 1 : -1;
+            }
+            else if (op == 'I') {
+                score += k == 0 ? -3 : -2;
+                i++;
+            }
+            else {
+                score += k == 0 ? -3 : -2;
+                j++;
+            }
+        }
+    }
+    if (i != aln.read_end || j != aln.ref_end - ref_offset) return -1000;
+    return score;
+}
+
+static long testTrace(mt19937& rng, int round_num) {
+    // CIGAR of the winning window, rescored along its path
+    long fail_cnt = 0;
+    for (int r = 0; r < round_num; r++) {
+        BMLSelector sel(4 + rng() % 29);
+        sel.setBandWidth(rng() % 20);
+        string read = randomSeq(rng, 20 + rng() % 130, 4);
+        string strand_read[STRAND_NUM] = {read, ""};
+        reverseComplement(read, strand_read[REVERSE_STRAND]);
+        sel.init();
+        sel.setRead(read);
+
+        int cand_num = 1 + rng() % 10;
+        vector<string> refs(cand_num);
+        vector<long> locs(cand_num);
+        vector<int> strands(cand_num);
+        for (int c = 0; c < cand_num; c++) {
+            strands[c] = rng() % 2;
+            locs[c] = c * 1000;
+            refs[c] = randomWindow(rng, strand_read[strands[c]]);
+            sel.addCandidate(locs[c], strands[c]) = refs[c];
+        }
+        sel.alignCandidates();
+
+        Alignment aln;
+        bool traced = sel.traceAlignment(aln);
+        if (!traced) {
+            if (sel.getMaxScore() > 0) fail_cnt++;
+            continue;
+        }
+        int c = aln.ref_begin / 1000;
+        int score = scoreCigar(aln, refs[c], locs[c], strand_read[aln.strand]);
+        if (score != sel.getMaxScore() || aln.strand != sel.getMapStrand() ||
+            aln.cigar[aln.cigar.size() - 1] != 'M') {
+            cerr << "[testTrace] Round " << r << ": score "
+                 << sel.getMaxScore() << ", CIGAR " << aln.cigar
+                 << " scores " << score << endl;
+            fail_cnt++;
+        }
+    }
+    return fail_cnt;
+}
+
+int main(int argc, char const* argv[]) {
+    mt19937 rng(570);
+    int round_num = 1000;
+
+    long striped_fail = testStriped(rng, round_num);
+    cout << "[main] Striped:    " << striped_fail << " of " << round_num
+         << " failed" << endl;
+
+    long banded_cnt = 0;
+    long full_cnt = 0;
+    long cand_fail = testCandidates(rng, round_num, banded_cnt, full_cnt);
+    cout << "[main] Candidates: " << cand_fail << " of " << round_num
+         << " failed, " << banded_cnt << " banded and " << full_cnt
+         << " full windows (" << (cpuHasAVX2() ? 16 : 8) << " lanes)" << endl;
+
+    long trace_fail = testTrace(rng, round_num);
+    cout << "[main] Trace:      " << trace_fail << " of " << round_num
+         << " failed" << endl;
+
+    if (striped_fail + cand_fail + trace_fail > 0) exit(1);
+    return 0;
+}
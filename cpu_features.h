@@ -0,0 +1,16 @@
+#ifndef __CPU_FEATURES__
+#define __CPU_FEATURES__
+
+/*
+SIMD kernels are compiled for the x86-64 baseline (SSE2) and for AVX2,
+and picked when the mapper runs. One binary then runs on every node,
+whatever CPU it was built on.
+*/
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+static inline bool cpuHasAVX2() {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+}
+
+#endif
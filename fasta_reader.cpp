@@ -0,0 +1,128 @@
+#include "fasta_reader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+FastaReader::FastaReader(string path) {
+    _path = path;
+    _data = NULL;
+    _size = 0;
+}
+
+FastaReader::~FastaReader() {
+    if (_data != NULL) munmap(_data, _size);
+}
+
+bool FastaReader::open() {
+    int fd = ::open(_path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    fstat(fd, &st);
+    _size = st.st_size;
+    if (_size == 0) {
+        close(fd);
+        return true;
+    }
+
+    void* base = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        cerr << "[FastaReader] Cannot map " << _path << endl;
+        exit(1);
+    }
+    _data = (char*)base;
+    madvise(_data, _size, MADV_SEQUENTIAL);
+    return true;
+}
+
+long FastaReader::countBases() {
+    /*
+    Number of bases read() appends, without packing them. A .fai index
+    at least as new as the FASTA gives the record lengths directly,
+    otherwise the line lengths of the mapped file are summed.
+    */
+    string fai_path = _path + ".fai";
+    struct stat fa_st, fai_st;
+    if (stat(_path.c_str(), &fa_st) == 0 &&
+        stat(fai_path.c_str(), &fai_st) == 0 &&
+        fai_st.st_mtime >= fa_st.st_mtime) {
+        ifstream fai(fai_path);
+        string line;
+        long bases = 0;
+        bool valid = true;
+        while (valid && getline(fai, line)) {
+            // <name> <length> <offset> <bases per line> <bytes per line>
+            istringstream fields(line);
+            string name;
+            long len;
+            valid = bool(fields >> name >> len) && len >= 0;
+            bases += len;
+        }
+        if (valid && bases > 0) return bases;
+    }
+
+    long bases = 0;
+    long pos = 0;
+    while (pos < _size) {
+        const char* line = _data + pos;
+        const char* eol = (const char*)memchr(line, '\n', _size - pos);
+        long line_len = eol ? eol - line : _size - pos;
+        pos += line_len + 1;
+        if (line_len > 0 && line[0] != '>') {
+            if (line[line_len - 1] == '\r') line_len -= 1;
+            bases += line_len;
+        }
+    }
+    return bases;
+}
+
+long FastaReader::read(PackedRefSeq* ref_seq, long max_len) {
+    /*
+    Append the bases of every record to ref_seq, up to max_len bases.
+    Header lines start a contig, line breaks are dropped. Pages
+    already parsed are released as the scan moves on.
+    */
+    long begin_len = ref_seq->getLen();
+    long pos = 0;
+    long released = 0;
+    while (pos < _size && ref_seq->getLen() - begin_len < max_len) {
+        const char* line = _data + pos;
+        const char* eol = (const char*)memchr(line, '\n', _size - pos);
+        long line_len = eol ? eol - line : _size - pos;
+        pos += line_len + 1;
+
+        if (line_len > 0 && line[0] == '>') {
+            // The record name runs up to the first blank
+            long name_len = 1;
+            while (name_len < line_len && !isspace(line[name_len]))
+                name_len++;
+            ref_seq->addContig(string(line + 1, name_len - 1),
+                               ref_seq->getLen());
+        }
+        else if (line_len > 0) {
+            if (line[line_len - 1] == '\r') line_len -= 1;
+            if (ref_seq->getContigs().empty())
+                ref_seq->addContig("unnamed", ref_seq->getLen());
+            long room = max_len - (ref_seq->getLen() - begin_len);
+            ref_seq->append(line, min(line_len, room));
+        }
+
+        if (pos - released >= FASTA_WINDOW) {
+            long page = sysconf(_SC_PAGESIZE);
+            long release_end = min(pos, _size) / page * page;
+            madvise(_data + released, release_end - released, MADV_DONTNEED);
+            released = release_end;
+        }
+    }
+    return ref_seq->getLen() - begin_len;
+}
@@ -0,0 +1,28 @@
+#include <cstdint>
+#include <string>
+
+#include "packed_ref_seq.h"
+
+using namespace std;
+
+#ifndef __FASTA_READER__
+#define __FASTA_READER__
+
+// Bytes of the mapped file handed to the kernel at a time
+#define FASTA_WINDOW (64L * 1024 * 1024)
+
+class FastaReader {
+   private:
+    string _path;
+    char* _data;
+    long _size;
+
+   public:
+    FastaReader(string);
+    ~FastaReader();
+    bool open();
+    long countBases();
+    long read(PackedRefSeq*, long);
+};
+
+#endif
@@ -0,0 +1,138 @@
+#include "index_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+IndexFile::IndexFile(string path) {
+    _path = path;
+    _write_pos = 0;
+    _base = NULL;
+    _size = 0;
+}
+
+IndexFile::~IndexFile() {
+    if (_base != NULL) munmap(_base, _size);
+}
+
+void IndexFile::pad() {
+    // Zero fill up to the next section boundary
+    static const char zeros[INDEX_ALIGN] = {0};
+    int64_t pad_len = (INDEX_ALIGN - _write_pos % INDEX_ALIGN) % INDEX_ALIGN;
+    _os.write(zeros, pad_len);
+    _write_pos += pad_len;
+}
+
+void IndexFile::create() {
+    /*
+    Write next to the index and rename it over the index in finish().
+    Other processes may have the index mapped, and a failed write must
+    not leave a broken index behind.
+    */
+    string tmp_path = _path + ".tmp";
+    _os.open(tmp_path, ios::out | ios::binary | ios::trunc);
+    if (!_os.is_open()) {
+        cerr << "[IndexFile] Cannot open " << tmp_path << endl;
+        exit(1);
+    }
+
+    // Reserve space for the header, it is written by finish()
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    _os.write((char*)&header, sizeof(header));
+    _write_pos = sizeof(header);
+}
+
+int64_t IndexFile::appendSection(const void* data, int64_t bytes) {
+    pad();
+    int64_t offset = _write_pos;
+
+    // Write in large blocks
+    const int64_t block = 64 * 1024 * 1024;
+    for (int64_t done = 0; done < bytes; done += block) {
+        _os.write((const char*)data + done, min(block, bytes - done));
+    }
+    _write_pos += bytes;
+    return offset;
+}
+
+void IndexFile::finish(IndexHeader& header) {
+    pad();
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.file_size = _write_pos;
+
+    _os.seekp(0);
+    _os.write((char*)&header, sizeof(header));
+    _os.flush();
+    bool written = _os.good();
+    _os.close();
+    string tmp_path = _path + ".tmp";
+    if (!written || _os.fail()) {
+        cerr << "[IndexFile] Failed to write " << tmp_path << endl;
+        remove(tmp_path.c_str());
+        exit(1);
+    }
+    if (rename(tmp_path.c_str(), _path.c_str()) != 0) {
+        cerr << "[IndexFile] Cannot rename " << tmp_path << " to " << _path
+             << endl;
+        remove(tmp_path.c_str());
+        exit(1);
+    }
+}
+
+bool IndexFile::reject(string reason) {
+    // An unusable index is retrained rather than fatal
+    cout << "[IndexFile] " << _path << " " << reason << ", ignore it" << endl;
+    if (_base != NULL) munmap(_base, _size);
+    _base = NULL;
+    _size = 0;
+    return false;
+}
+
+bool IndexFile::open() {
+    int fd = ::open(_path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    fstat(fd, &st);
+    _size = st.st_size;
+    if (_size < sizeof(IndexHeader)) {
+        close(fd);
+        return reject("is truncated");
+    }
+
+    // Shared mapping, so concurrent mapper processes share the page cache
+    void* base = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return reject("cannot be mapped");
+    _base = (uint8_t*)base;
+
+    IndexHeader* header = getHeader();
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0)
+        return reject("is not an index file");
+    if (header->version != INDEX_VERSION)
+        return reject("has version " + to_string(header->version) +
+                      ", expected " + to_string(INDEX_VERSION));
+    if (header->file_size != _size || header->layer_num > INDEX_MAX_LAYER)
+        return reject("is corrupted");
+    return true;
+}
+
+IndexHeader* IndexFile::getHeader() { return (IndexHeader*)_base; }
+
+void* IndexFile::getSection(int64_t offset, int64_t bytes) {
+    if (offset < 0 || bytes < 0 || offset + bytes > _size) {
+        cerr << "[IndexFile] " << _path << " is corrupted" << endl;
+        exit(1);
+    }
+
+    // Bloom filter probes are random, readahead only wastes page cache
+    if (bytes > 0) madvise(_base + offset, bytes, MADV_RANDOM);
+    return _base + offset;
+}
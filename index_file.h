@@ -0,0 +1,102 @@
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+using namespace std;
+
+#ifndef __INDEX_FILE__
+#define __INDEX_FILE__
+
+#define INDEX_MAGIC "SRMINDEX"
+#define INDEX_VERSION 5
+#define INDEX_MAX_LAYER 8
+
+// Sections start on a page boundary so they can be used in place
+#define INDEX_ALIGN 4096
+
+/* Index file layout:
+IndexHeader
+Layer 0 memory
+...
+Layer N-1 memory
+Packed reference
+Ambiguous runs of the reference
+Contig starts
+Contig names, each followed by a '\0'
+*/
+typedef struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t layer_num;
+
+    // Geometry
+    int64_t seed_len;
+    int64_t ref_len;
+    int64_t mem_arrangement;
+
+    // Seeds the Bloom filters were trained with, see seed_selector.h
+    int64_t seed_select_mode;
+    int64_t seed_select_param;
+
+    // Inputs of the training, to detect a stale index
+    int64_t ref_file_size;
+    int64_t ref_file_mtime;
+    int64_t ignore_satellite;
+    int64_t satellite_threshold;
+    int64_t seed_count_mode;
+
+    int64_t bf_size[INDEX_MAX_LAYER];
+    int64_t bf_amount[INDEX_MAX_LAYER];
+    int64_t bf_total[INDEX_MAX_LAYER];
+    int64_t seed_range[INDEX_MAX_LAYER];
+    uint64_t hash_factor[INDEX_MAX_LAYER];
+    int64_t hash_num[INDEX_MAX_LAYER];
+
+    // Sections, as byte offsets from the start of the file
+    int64_t layer_offset[INDEX_MAX_LAYER];
+    int64_t layer_bytes[INDEX_MAX_LAYER];
+    int64_t ref_offset;
+    int64_t ref_bytes;
+    int64_t ambiguous_offset;
+    int64_t ambiguous_num;
+    int64_t contig_offset;
+    int64_t contig_num;
+    int64_t contig_name_offset;
+    int64_t contig_name_bytes;
+    int64_t file_size;
+} IndexHeader;
+
+class IndexFile {
+   private:
+    string _path;
+
+    // Writing
+    ofstream _os;
+    int64_t _write_pos;
+
+    // Reading, the whole file is memory mapped
+    uint8_t* _base;
+    int64_t _size;
+
+    void pad();
+    bool reject(string);
+
+   public:
+    IndexFile(string);
+    ~IndexFile();
+
+    // Write a new index: create(), one appendSection() per section,
+    // then finish() with the complete header, which replaces the file at
+    // the path in one rename.
+    void create();
+    int64_t appendSection(const void*, int64_t);
+    void finish(IndexHeader&);
+
+    // Map an existing index read-only. Returns false if it does not exist
+    // or is not a complete index of this version.
+    bool open();
+    IndexHeader* getHeader();
+    void* getSection(int64_t, int64_t);
+};
+
+#endif
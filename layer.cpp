@@ -2,13 +2,29 @@
 #include "layer.h"
 
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 
+#include <immintrin.h>
+
+#include "cpu_features.h"
+
+static bool isPow2(long n) { return n > 0 && (n & (n - 1)) == 0; }
+
+// Hash bits of a rotation within a block, log2(BLOCK_BITS)
+static const int rotation_bits = 9;
+static const int block_words = BLOCK_BITS / 32;
+
 void Layer::genBFMask() {
-    _bf_bitwidth = log2(double(_bf_size));
+    if (isPow2(_bf_size))
+        _bf_bitwidth = __builtin_ctzl(_bf_size);
+    else
+        _bf_bitwidth = log2(double(_bf_size));
 
+    _bf_mask = 0;
     for (int i = 0; i < _bf_bitwidth; i++) {
         _bf_mask = (_bf_mask << 1) + 1;
     }
@@ -19,7 +35,7 @@ bool Layer::isHit(int mem_content, int mem_bit) {
 }
 
 Layer::Layer(long bf_size, long bf_amount, long bf_total, long seed_range,
-             uint64_t& hash_factor) {
+             uint64_t& hash_factor, int hash_num) {
     _bf_size = bf_size;
     _bf_amount = bf_amount;
     _bf_total = bf_total;
@@ -27,25 +43,128 @@ Layer::Layer(long bf_size, long bf_amount, long bf_total, long seed_range,
     genBFMask();
     _hash_factor = hash_factor;
 
-    // Memory array
+    _pow2 = isPow2(bf_amount) && isPow2(seed_range);
+    _amount_pow2 = isPow2(bf_amount);
+    _amount_shift = _amount_pow2 ? __builtin_ctzl(bf_amount) : 0;
+    _range_shift = _pow2 ? __builtin_ctzl(seed_range) : 0;
+
+    // Blocks of a group of siblings are picked by the hash bits left over
+    // by the rotations
+    _hash_num = hash_num;
+    _block_mask = 0;
+    if (_hash_num > 1) {
+        long block_num = bf_size * bf_amount / BLOCK_BITS;
+        bool valid = isPow2(bf_size) && isPow2(bf_amount) &&
+                     bf_amount >= 32 && bf_amount <= BLOCK_BITS &&
+                     _hash_num <= BLOCK_MAX_HASH &&
+                     rotation_bits * _hash_num +
+                             __builtin_ctzl(block_num) <= 64;
+        if (!valid) {
+            cerr << "[Layer] " << _hash_num << " hashes need a power of two "
+                 << "of 32 to " << BLOCK_BITS << " Bloom filters and at most "
+                 << BLOCK_MAX_HASH << " hashes" << endl;
+            exit(1);
+        }
+        _block_mask = block_num - 1;
+    }
+
+    // Memory array, set by allocate() or attach()
     _mem_size = (bf_size / 32) * bf_total;
-    _memory = new int[_mem_size];
+    _memory = NULL;
+    _own_memory = false;
+    _block.base = NULL;
 
     // Memory arrangement
     _mem_arrangement = INTERLEAVED;
+    _use_avx2 = cpuHasAVX2();
+
+    // Group offsets are multiples of bf_amount * bf_size, so with whole
+    // words of siblings they are word aligned too
+    _word_wise = _mem_arrangement == INTERLEAVED && bf_amount % 32 == 0 &&
+                 bf_amount <= QUERY_MAX_AMOUNT;
+    _word_num = bf_amount / 32;
+}
+
+Layer::~Layer() {
+    if (_own_memory) freeMemory(_block);
 }
 
-Layer::~Layer() { delete _memory; }
+void Layer::allocate(const MemConfig& config, int node) {
+    // Zeroed memory, aligned so that a block is one cache line
+    if (_own_memory) freeMemory(_block);
+    _block = allocMemory(_mem_size * sizeof(int), config, node);
+    _memory = (int*)_block.base;
+    _own_memory = true;
+}
 
-void Layer::update(uint64_t& seed, long base_cnt) {
+void Layer::attach(int* memory) {
+    // Use memory owned by someone else, e.g. a mapped index file.
+    // Attached memory may be read-only, so only query() is allowed.
+    if (_own_memory) freeMemory(_block);
+    _block.base = NULL;
+    _memory = memory;
+    _own_memory = false;
+}
+
+Layer* Layer::replicate(const MemConfig& config, int node) {
+    // Copy of the trained filters in memory bound to node, the copy
+    // touches every page
+    MemConfig copy_config = config;
+    copy_config.touch_threads = 0;
+    Layer* copy = new Layer(_bf_size, _bf_amount, _bf_total, _seed_range,
+                            _hash_factor, _hash_num);
+    copy->allocate(copy_config, node);
+    memcpy(copy->_memory, _memory, _mem_size * sizeof(int));
+    return copy;
+}
+
+const MemBlock& Layer::getBlock() { return _block; }
+
+int* Layer::getMemory() { return _memory; }
+
+long Layer::getMemSize() { return _mem_size; }
+
+uint64_t Layer::getHashFactor() { return _hash_factor; }
+
+int Layer::getHashNum() { return _hash_num; }
+
+uint64_t Layer::mixHash(uint64_t& seed) {
+    // fmix64 of MurmurHash3, every bit of the seed reaches every hash bit
+    uint64_t h = seed ^ _hash_factor;
+    h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+    h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+MemArrangement Layer::getMemArrangement() { return _mem_arrangement; }
+
+template <bool POW2>
+void Layer::getMemLoc(uint64_t& seed, long base_cnt, int hash_id,
+                      long& mem_addr, int& mem_bit) {
     // hash function
     uint64_t hash_val = (seed ^ _hash_factor) & _bf_mask;
 
-    // Hierarchical Bloom filter
-    long last_layer_range = (long)_seed_range * (long)_bf_amount;
-    long nth_last_layer = base_cnt / last_layer_range;
-    long hier_offset = nth_last_layer * _bf_amount * _bf_size;
+    // Hierarchical Bloom filter, nth_bf is the Bloom filter among its
+    // siblings that covers base_cnt
+    long nth_last_layer;
+    long nth_bf;
+    if (POW2) {
+        long nth_range = base_cnt >> _range_shift;
+        nth_last_layer = nth_range >> _amount_shift;
+        nth_bf = nth_range & (_bf_amount - 1);
+    }
+    else {
+        long last_layer_range = (long)_seed_range * (long)_bf_amount;
+        nth_last_layer = base_cnt / last_layer_range;
+        nth_bf = (base_cnt % last_layer_range) / _seed_range;
+    }
+    long hier_offset;
+    if (POW2)
+        hier_offset = (nth_last_layer * _bf_size) << _amount_shift;
+    else
+        hier_offset = nth_last_layer * _bf_amount * _bf_size;
 
+    long mem_idx = 0;
     if (_mem_arrangement == INORDERED) {
         /* Memory content:
         N = _bf_size
@@ -55,12 +174,8 @@ void Layer::update(uint64_t& seed, long base_cnt) {
         bf[255] bit 0, 1, ..., N
         */
         long bit_offset = hash_val;
-        long bf_offset =
-            ((base_cnt % last_layer_range) / _seed_range) * _bf_size;
-        long mem_idx = hier_offset + bit_offset + bf_offset;
-        long mem_addr = mem_idx / 32;
-        long mem_bit = mem_idx % 32;
-        _memory[mem_addr] |= 1 << (31 - mem_bit);
+        long bf_offset = nth_bf * _bf_size;
+        mem_idx = hier_offset + bit_offset + bf_offset;
     }
     else if (_mem_arrangement == INTERLEAVED) {
         /* Memory content:
@@ -69,38 +184,238 @@ void Layer::update(uint64_t& seed, long base_cnt) {
         ...
         bit N of bf[0] bf[1] ... bf[255]
         */
-        long bit_offset = hash_val * _bf_amount;
-        long bf_offset = (base_cnt % last_layer_range) / _seed_range;
-        long mem_idx = hier_offset + bit_offset + bf_offset;
-        long mem_addr = mem_idx / 32;
-        long mem_bit = mem_idx % 32;
-        _memory[mem_addr] |= 1 << (31 - mem_bit);
+        long bit_offset = POW2 ? hash_val << _amount_shift
+                               : hash_val * _bf_amount;
+        long bf_offset = nth_bf;
+        if (_hash_num > 1) {
+            // Bit of hash_id in the block of the seed, see layer.h
+            uint64_t hash = mixHash(seed);
+            long block = (hash >> (rotation_bits * _hash_num)) & _block_mask;
+            long rotation = (hash >> (rotation_bits * hash_id)) &
+                            (BLOCK_BITS - 1);
+            bit_offset = block * BLOCK_BITS;
+            bf_offset = (nth_bf + rotation) & (BLOCK_BITS - 1);
+        }
+        mem_idx = hier_offset + bit_offset + bf_offset;
+    }
+    mem_addr = mem_idx >> 5;
+    mem_bit = mem_idx & 31;
+}
+
+template <bool POW2, bool ATOMIC>
+void Layer::updateBits(uint64_t& seed, long base_cnt) {
+    long mem_addr;
+    int mem_bit;
+    for (int h = 0; h < _hash_num; h++) {
+        getMemLoc<POW2>(seed, base_cnt, h, mem_addr, mem_bit);
+        if (ATOMIC)
+            __sync_fetch_and_or(&_memory[mem_addr], 1 << (31 - mem_bit));
+        else
+            _memory[mem_addr] |= 1 << (31 - mem_bit);
+    }
+}
+
+void Layer::update(uint64_t& seed, long base_cnt) {
+    if (_pow2)
+        updateBits<true, false>(seed, base_cnt);
+    else
+        updateBits<false, false>(seed, base_cnt);
+}
+
+void Layer::updateAtomic(uint64_t& seed, long base_cnt) {
+    // Same as update(), but safe when several threads train Bloom filters
+    // that share memory words.
+    if (_pow2)
+        updateBits<true, true>(seed, base_cnt);
+    else
+        updateBits<false, true>(seed, base_cnt);
+}
+
+TARGET_AVX2 static void addHitWordsAVX2(uint32_t words[], int word_num,
+                                        uint8_t hit_cnt[]) {
+    // Byte k of the expanded word holds bit 31 - k of the word
+    const __m256i shuffle = _mm256_setr_epi8(
+        3, 3, 3, 3, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2,
+        1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i bit_sel = _mm256_set1_epi64x(0x0102040810204080);
+    const __m256i one = _mm256_set1_epi8(1);
+    for (int w = 0; w < word_num; w++) {
+        __m256i bits = _mm256_shuffle_epi8(_mm256_set1_epi32(words[w]), shuffle);
+        __m256i hit = _mm256_min_epu8(_mm256_and_si256(bits, bit_sel), one);
+        __m256i* cnt = (__m256i*)&hit_cnt[w * 32];
+        _mm256_storeu_si256(cnt,
+                            _mm256_adds_epu8(_mm256_loadu_si256(cnt), hit));
+    }
+}
+
+void Layer::addHitWords(uint32_t words[], int word_num, uint8_t hit_cnt[]) {
+    /*
+    Add one hit per set bit to the 8-bit saturating hit counters.
+    Bit 31 of words[w] belongs to Bloom filter 32 * w.
+    */
+    if (_use_avx2) {
+        addHitWordsAVX2(words, word_num, hit_cnt);
+        return;
+    }
+    for (int w = 0; w < word_num; w++) {
+        uint32_t bits = words[w];
+        if (bits == 0) continue;
+        for (int k = 0; k < 32; k++) {
+            uint8_t& cnt = hit_cnt[w * 32 + k];
+            cnt += ((bits >> (31 - k)) & 1) & (cnt != 255);
+        }
+    }
+}
+
+template <bool POW2>
+uint32_t* Layer::getWordLoc(uint64_t& seed, long hier_offset) {
+    // First word of the siblings' bits, hier_offset is word aligned
+    uint64_t word = (uint64_t)hier_offset >> 5;
+    if (_hash_num > 1) {
+        uint64_t block = (mixHash(seed) >> (rotation_bits * _hash_num)) &
+                         _block_mask;
+        word += block * block_words;
+    }
+    else {
+        // hash_function
+        uint64_t hash_val = (seed ^ _hash_factor) & _bf_mask;
+        word += POW2 ? hash_val << (_amount_shift - 5) : hash_val * _word_num;
     }
+    return (uint32_t*)&_memory[word];
 }
 
-void Layer::query(uint64_t& seed, int hit_cnt[], long hier_offset,
+void Layer::loadBlockWords(uint64_t hash, uint32_t* block, uint32_t words[]) {
+    /*
+    Rotate the block left by each rotation, so that bit i of the result
+    is the bit of Bloom filter i, and AND the rotated blocks.
+    */
+    int word_num = _word_num;
+    for (int w = 0; w < word_num; w++) {
+        words[w] = 0xFFFFFFFF;
+    }
+    for (int h = 0; h < _hash_num; h++) {
+        int rotation = (hash >> (rotation_bits * h)) & (BLOCK_BITS - 1);
+        int word_shift = rotation >> 5;
+        int bit_shift = rotation & 31;
+        for (int w = 0; w < word_num; w++) {
+            uint32_t high = block[(w + word_shift) & (block_words - 1)];
+            uint32_t low = block[(w + word_shift + 1) & (block_words - 1)];
+            if (bit_shift)
+                high = (high << bit_shift) | (low >> (32 - bit_shift));
+            words[w] &= high;
+        }
+    }
+}
+
+void Layer::loadWords(uint64_t& seed, uint32_t* mem, bool or_next,
+                      uint32_t words[]) {
+    /*
+    The bits of all sibling Bloom filters sit next to each other, so
+    load them as whole words. OR-ing the next Bloom filter is a shift
+    by one bit plus the top bit of the next word.
+    */
+    int word_num = _word_num;
+    if (_hash_num > 1) {
+        loadBlockWords(mixHash(seed), mem, words);
+    }
+    else {
+        for (int w = 0; w < word_num; w++) {
+            words[w] = mem[w];
+        }
+    }
+    if (or_next) {
+        for (int w = 0; w < word_num - 1; w++) {
+            words[w] |= (words[w] << 1) | (words[w + 1] >> 31);
+        }
+        words[word_num - 1] |= words[word_num - 1] << 1;
+    }
+}
+
+template <bool POW2>
+void Layer::queryPairWords(uint64_t& seed_a, uint8_t hit_cnt_a[],
+                           uint64_t& seed_b, uint8_t hit_cnt_b[],
+                           long hier_offset, bool or_next) {
+    uint32_t* mem_a = getWordLoc<POW2>(seed_a, hier_offset);
+    uint32_t* mem_b = getWordLoc<POW2>(seed_b, hier_offset);
+    __builtin_prefetch(mem_a);
+    __builtin_prefetch(mem_b);
+
+    uint32_t words_a[QUERY_MAX_AMOUNT / 32];
+    uint32_t words_b[QUERY_MAX_AMOUNT / 32];
+    loadWords(seed_a, mem_a, or_next, words_a);
+    loadWords(seed_b, mem_b, or_next, words_b);
+    addHitWords(words_a, _word_num, hit_cnt_a);
+    addHitWords(words_b, _word_num, hit_cnt_b);
+}
+
+void Layer::queryPair(uint64_t& seed_a, uint8_t hit_cnt_a[], uint64_t& seed_b,
+                      uint8_t hit_cnt_b[], long hier_offset, bool or_next) {
+    /*
+    Query two seeds, e.g. both strands of a read, against the same
+    Bloom filters. Both memory locations are requested before either
+    is counted, so the two cache misses overlap.
+    */
+    if (!_word_wise) {
+        query(seed_a, hit_cnt_a, hier_offset, or_next);
+        query(seed_b, hit_cnt_b, hier_offset, or_next);
+    }
+    else if (_amount_pow2) {
+        queryPairWords<true>(seed_a, hit_cnt_a, seed_b, hit_cnt_b,
+                             hier_offset, or_next);
+    }
+    else {
+        queryPairWords<false>(seed_a, hit_cnt_a, seed_b, hit_cnt_b,
+                              hier_offset, or_next);
+    }
+}
+
+void Layer::prefetch(uint64_t& seed, long hier_offset) {
+    // Request the words query() loads for the seed, without waiting
+    if (!_word_wise) return;
+    uint32_t* mem = _amount_pow2 ? getWordLoc<true>(seed, hier_offset)
+                                 : getWordLoc<false>(seed, hier_offset);
+    __builtin_prefetch(mem);
+    if (_hash_num == 1) __builtin_prefetch(mem + _word_num - 1);
+}
+
+template <bool POW2>
+void Layer::queryWords(uint64_t& seed, uint8_t hit_cnt[], long hier_offset,
+                       bool or_next) {
+    uint32_t words[QUERY_MAX_AMOUNT / 32];
+    loadWords(seed, getWordLoc<POW2>(seed, hier_offset), or_next, words);
+    addHitWords(words, _word_num, hit_cnt);
+}
+
+void Layer::query(uint64_t& seed, uint8_t hit_cnt[], long hier_offset,
                   bool or_next) {
+    if (_word_wise) {
+        if (_amount_pow2)
+            queryWords<true>(seed, hit_cnt, hier_offset, or_next);
+        else
+            queryWords<false>(seed, hit_cnt, hier_offset, or_next);
+        return;
+    }
+
     // hash_function
     uint64_t hash_val = (seed ^ _hash_factor) & _bf_mask;
-
     if (_mem_arrangement == INORDERED) {
         long bit_offset = hash_val;
         for (int i = 0; i < _bf_amount; i++) {
             long bf_offset = i * _bf_size;
             long mem_idx = hier_offset + bit_offset + bf_offset;
-            long mem_addr = mem_idx / 32;
-            int mem_bit = mem_idx % 32;
+            long mem_addr = mem_idx >> 5;
+            int mem_bit = mem_idx & 31;
 
             bool hit = isHit(_memory[mem_addr], mem_bit);
 
             if (or_next && i < _bf_amount - 1) {
                 mem_idx += _bf_size;
-                mem_addr = mem_idx / 32;
-                mem_bit = mem_idx % 32;
+                mem_addr = mem_idx >> 5;
+                mem_bit = mem_idx & 31;
                 hit |= isHit(_memory[mem_addr], mem_bit);
             }
 
-            hit_cnt[i] += hit;
+            if (hit_cnt[i] != 255) hit_cnt[i] += hit;
         }
     }
     else if (_mem_arrangement == INTERLEAVED) {
@@ -108,19 +423,19 @@ void Layer::query(uint64_t& seed, int hit_cnt[], long hier_offset,
         for (int i = 0; i < _bf_amount; i++) {
             long bf_offset = i;
             long mem_idx = hier_offset + bit_offset + bf_offset;
-            long mem_addr = mem_idx / 32;
-            int mem_bit = mem_idx % 32;
+            long mem_addr = mem_idx >> 5;
+            int mem_bit = mem_idx & 31;
 
             bool hit = isHit(_memory[mem_addr], mem_bit);
 
             if (or_next && i < _bf_amount - 1) {
                 mem_idx += 1;
-                mem_addr = mem_idx / 32;
-                mem_bit = mem_idx % 32;
+                mem_addr = mem_idx >> 5;
+                mem_bit = mem_idx & 31;
                 hit |= isHit(_memory[mem_addr], mem_bit);
             }
 
-            hit_cnt[i] += hit;
+            if (hit_cnt[i] != 255) hit_cnt[i] += hit;
         }
     }
 }
@@ -140,35 +455,3 @@ void Layer::write_bf_hex(string path) {
         if (i % 16 == 15) bf_os << endl;
     }
 }
-
-void Layer::write_bf_bin(string path) {
-    ofstream bf_os(path, ios::out | ios::binary);
-
-    if (!bf_os.is_open()) {
-        cerr << "Cannot open " << path << endl;
-        exit(1);
-    }
-
-    cout << "Write Bloom filter content to file " << path << endl;
-
-    for (int i = 0; i < _mem_size; i++) {
-        bf_os.write((char*)&_memory[i], sizeof(int));
-    }
-    bf_os.close();
-}
-
-void Layer::read_bf_bin(string path) {
-    ifstream bf_is(path, ios::in | ios::binary);
-
-    if (!bf_is.is_open()) {
-        cerr << "Cannot open " << path << endl;
-        exit(1);
-    }
-
-    cout << "Read Bloom filter content from file " << path << endl;
-
-    for (int i = 0; i < _mem_size; i++) {
-        bf_is.read((char*)&_memory[i], sizeof(int));
-    }
-    bf_is.close();
-}
@@ -1,5 +1,9 @@
 
+#include <cstdint>
 #include <string>
+
+#include "mem_alloc.h"
+
 using namespace std;
 
 #ifndef __LAYER__
@@ -7,6 +11,20 @@ using namespace std;
 
 typedef enum MemArrangement { INORDERED, INTERLEAVED } MemArrangement;
 
+// Largest bf_amount served by the word-wise INTERLEAVED query
+#define QUERY_MAX_AMOUNT 1024
+
+/*
+Blocked Bloom filters, used when a layer has more than one hash.
+
+A seed picks one block of BLOCK_BITS bits in the INTERLEAVED memory of its
+sibling Bloom filters, and one rotation per hash. Hash j sets bit
+(nth_bf + rotation_j) % BLOCK_BITS of the block, so every sibling owns
+hash_num bits of the block and the query loads a single cache line.
+*/
+#define BLOCK_BITS 512
+#define BLOCK_MAX_HASH 4
+
 class Layer {
    private:
     long _bf_size;
@@ -17,25 +35,72 @@ class Layer {
     long _seed_range;
     long _mem_size;
 
+    // Shifts that replace the divisions of getMemLoc() when bf_amount and
+    // seed_range are powers of two, as in the default hierarchy. The word
+    // offsets of the query only need bf_amount to be one.
+    bool _pow2;
+    bool _amount_pow2;
+    int _amount_shift;
+    int _range_shift;
+
+    // Whether the query loads whole words, and the words of the bits
+    // of all siblings at one bit position
+    bool _word_wise;
+    int _word_num;
+
     // hash function parameters
     uint64_t _hash_factor;
 
+    // Blocked Bloom filters when _hash_num > 1
+    int _hash_num;
+    uint64_t _block_mask;
+
     // Memory arrangement
     MemArrangement _mem_arrangement;
 
-    // Bloom filter memory
+    // Whether hits are counted with the AVX2 kernel
+    bool _use_avx2;
+
+    // Bloom filter memory, either owned or attached from an index file
     int* _memory;
+    bool _own_memory;
+    MemBlock _block;
     void genBFMask();
     bool isHit(int, int);
+    template <bool POW2>
+    void getMemLoc(uint64_t&, long, int, long&, int&);
+    template <bool POW2, bool ATOMIC>
+    void updateBits(uint64_t&, long);
+    uint64_t mixHash(uint64_t&);
+    template <bool POW2>
+    uint32_t* getWordLoc(uint64_t&, long);
+    template <bool POW2>
+    void queryWords(uint64_t&, uint8_t[], long, bool);
+    template <bool POW2>
+    void queryPairWords(uint64_t&, uint8_t[], uint64_t&, uint8_t[], long,
+                        bool);
+    void loadWords(uint64_t&, uint32_t*, bool, uint32_t[]);
+    void loadBlockWords(uint64_t, uint32_t*, uint32_t[]);
+    void addHitWords(uint32_t[], int, uint8_t[]);
 
    public:
-    Layer(long, long, long, long, uint64_t&);
+    Layer(long, long, long, long, uint64_t&, int);
     ~Layer();
     void update(uint64_t&, long);
-    void query(uint64_t&, int[], long, bool);
+    void updateAtomic(uint64_t&, long);
+    void query(uint64_t&, uint8_t[], long, bool);
+    void queryPair(uint64_t&, uint8_t[], uint64_t&, uint8_t[], long, bool);
+    void prefetch(uint64_t&, long);
+    void allocate(const MemConfig&, int);
+    void attach(int*);
+    Layer* replicate(const MemConfig&, int);
+    const MemBlock& getBlock();
+    int* getMemory();
+    long getMemSize();
+    uint64_t getHashFactor();
+    int getHashNum();
+    MemArrangement getMemArrangement();
     void write_bf_hex(string);
-    void write_bf_bin(string);
-    void read_bf_bin(string);
 };
 
 #endif
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <thread>
 
 #include "short_read_mapper.h"
 
@@ -7,6 +8,21 @@ int main(int argc, char const* argv[]) {
     string ref_path = "../dataset/hg38_short.fa";
     string read_path = "../dataset/single_HSXn_100bp_1f.aln";
 
+    // Trained index. It is built from ref_path on the first run and
+    // memory-mapped on later runs.
+    string index_path = "../dataset/hg38_short.idx";
+
+    // Geometry of the Bloom filter layers, see layers.cfg.
+    string layer_config_path = "layers.cfg";
+
+    // Counters, latencies and durations of the run, as JSON.
+    string metrics_path = "metrics.json";
+
+    // Alignment of every read, SAM_FORMAT or PAF_FORMAT. PAF only lists
+    // mapped reads. An empty path writes nothing.
+    string output_path = "mapped.sam";
+    OutputFormat output_format = SAM_FORMAT;
+
     // Configuration
     long read_len = 100;
     long seed_len = 20;
@@ -24,14 +40,74 @@ int main(int argc, char const* argv[]) {
     // If a read has #CMLs > N, then it's considered a satellite DNA.
     long satellite_threshold = 15;
 
+    // Number of threads used to train the Bloom filters and map the reads.
+    int thread_num = thread::hardware_concurrency();
+
+    // Reads a thread walks through the layers at once, so that the cache
+    // misses of one read overlap with the work on the others.
+    int walk_num = 8;
+
+    // A read stops walking the layers once it has made probe_budget seed
+    // queries or found cml_budget CMLs, and is aligned with the CMLs found
+    // so far. The walk goes best first, so those are the likeliest ones.
+    // 0 for no limit.
+    long probe_budget = 8192;
+    long cml_budget = 32;
+
+    // Smith-Waterman only scores cells within N diagonals of the seed
+    // matches, 0 always fills the whole matrix.
+    int band_width = 16;
+
+    // Pages and NUMA placement of the layers and the reference, see
+    // mem_alloc.h. The pages are zeroed by thread_num threads when they
+    // are allocated, rather than faulted in one by one while training.
+    MemConfig mem_config;
+    mem_config.huge_pages = TRANSPARENT_HUGE_PAGES;
+    mem_config.numa = NUMA_LOCAL;
+    mem_config.touch_threads = thread_num;
+
+    // How seeds are counted when training ignores satellite DNA:
+    // EXACT_COUNT or SKETCH_COUNT, see seed_counter.h.
+    SeedCountMode seed_count_mode = EXACT_COUNT;
+
+    // Seeds used to train and query, see seed_selector.h. STRIDE_SEEDS
+    // queries every query_shift_amt-th seed and trains all of them.
+    // MINIMIZER_SEEDS takes the window length as parameter, SYNCMER_SEEDS
+    // the s-mer length; both train and query only the selected seeds.
+    SeedSelectMode seed_select_mode = STRIDE_SEEDS;
+    int seed_select_param = 10;
+
+    // With MINIMIZER_SEEDS or SYNCMER_SEEDS, a CML needs hits from this
+    // share of the kept seeds; hit_threshold only applies to STRIDE_SEEDS.
+    // Calibrated with bench_seeds.sh: higher shares leave reads with a few
+    // errors unmapped, lower ones flag reads as satellite.
+    double sampled_hit_share = 0.4;
+
     ShortReadMapper mapper = ShortReadMapper(
         ref_path, read_path, read_len, seed_len, query_shift_amt, hit_threshold,
         ans_margin, satellite_threshold);
 
+    mapper.loadLayerConfig(layer_config_path);
+    mapper.setThreadNum(thread_num);
+    mapper.setWalkNum(walk_num);
+    mapper.setWalkBudget(probe_budget, cml_budget);
+    mapper.setBandWidth(band_width);
+    mapper.setMemConfig(mem_config);
+    mapper.setSeedCountMode(seed_count_mode);
+    mapper.setSeedSelectMode(seed_select_mode, seed_select_param);
+    mapper.setSampledHitShare(sampled_hit_share);
+    mapper.setOutput(output_path, output_format);
+
+    // Whether training leaves seeds of satellite DNA out of the filters.
+    // An index trained otherwise, or from another reference, is retrained.
     bool ignoreSatellite = false;
-    mapper.trainBF(ignoreSatellite);
+    if (!mapper.loadIndex(index_path, ignoreSatellite)) {
+        mapper.trainBF(ignoreSatellite);
+        mapper.writeIndex(index_path);
+    }
     mapper.mapRead();
     mapper.displayResult();
+    mapper.writeMetrics(metrics_path);
 
     return 0;
 }
@@ -0,0 +1,222 @@
+#include "mem_alloc.h"
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+// Huge page size on x86-64, also the alignment of every block
+#define HUGE_PAGE_BYTES (2UL << 20)
+
+// Nodes a NUMA node mask can hold
+#define MAX_NUMA_NODES 1024
+
+static vector<int> parseList(string path) {
+    // Kernel list format, e.g. "0-3,8,10-11"
+    vector<int> ids;
+    ifstream is(path);
+    string list;
+    if (!getline(is, list)) return ids;
+    istringstream ls(list);
+    string range;
+    while (getline(ls, range, ',')) {
+        int first = 0, last = 0;
+        int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1) continue;
+        if (n == 1) last = first;
+        for (int i = first; i <= last; i++) ids.push_back(i);
+    }
+    return ids;
+}
+
+static bool transparentHugePagesOn() {
+    // "always" or "madvise" are selected, "never" turns madvise() off
+    ifstream is("/sys/kernel/mm/transparent_hugepage/enabled");
+    string modes;
+    getline(is, modes);
+    return !modes.empty() && modes.find("[never]") == string::npos;
+}
+
+static bool bindMemory(void* base, size_t bytes, int mode,
+                       const vector<int>& nodes) {
+    // mbind(2) without libnuma
+    vector<unsigned long> mask(MAX_NUMA_NODES / 64, 0);
+    for (int i = 0; i < nodes.size(); i++) {
+        if (nodes[i] < MAX_NUMA_NODES)
+            mask[nodes[i] / 64] |= 1UL << (nodes[i] % 64);
+    }
+    return syscall(SYS_mbind, base, bytes, mode, mask.data(),
+                   MAX_NUMA_NODES, 0) == 0;
+}
+
+static void touchRange(char* begin, size_t bytes) { memset(begin, 0, bytes); }
+
+static void touchMemory(char* base, size_t bytes, int thread_num) {
+    // Whole huge pages per thread, so that no page is faulted twice
+    size_t page_num = (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES;
+    thread_num = max(1, (int)min((size_t)thread_num, page_num));
+    size_t per_thread = (page_num + thread_num - 1) / thread_num;
+    vector<thread> workers;
+    for (int t = 0; t < thread_num; t++) {
+        size_t begin = min(bytes, t * per_thread * HUGE_PAGE_BYTES);
+        size_t end = min(bytes, (t + 1) * per_thread * HUGE_PAGE_BYTES);
+        if (begin < end)
+            workers.push_back(thread(touchRange, base + begin, end - begin));
+    }
+    for (int t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+}
+
+MemBlock allocMemory(size_t bytes, const MemConfig& config, int node) {
+    MemBlock block;
+    block.base = NULL;
+    block.bytes = bytes;
+    block.mapped_bytes = 0;
+    block.explicit_huge = false;
+    block.explicit_short = false;
+    block.transparent_huge = false;
+    block.interleaved = false;
+    block.node = -1;
+    if (bytes == 0) return block;
+
+    size_t len = (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES *
+                 HUGE_PAGE_BYTES;
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    // The hugetlb pool is reserved at mmap() time, so a short pool fails
+    // here rather than at the first touch
+    void* base = MAP_FAILED;
+    if (config.huge_pages == EXPLICIT_HUGE_PAGES) {
+        base = mmap(NULL, len, prot, flags | MAP_HUGETLB, -1, 0);
+        block.explicit_huge = base != MAP_FAILED;
+        block.explicit_short = !block.explicit_huge;
+    }
+    if (base == MAP_FAILED) {
+        // Map 2 MB more and trim to a huge page boundary
+        char* raw =
+            (char*)mmap(NULL, len + HUGE_PAGE_BYTES, prot, flags, -1, 0);
+        if (raw == MAP_FAILED) {
+            cerr << "[allocMemory] Cannot allocate " << bytes << " bytes"
+                 << endl;
+            exit(1);
+        }
+        size_t head = (HUGE_PAGE_BYTES - (uintptr_t)raw % HUGE_PAGE_BYTES) %
+                      HUGE_PAGE_BYTES;
+        if (head > 0) munmap(raw, head);
+        munmap(raw + head + len, HUGE_PAGE_BYTES - head);
+        base = raw + head;
+
+        if (config.huge_pages == NO_HUGE_PAGES) {
+            madvise(base, len, MADV_NOHUGEPAGE);
+        }
+        else {
+            block.transparent_huge = transparentHugePagesOn() &&
+                                     madvise(base, len, MADV_HUGEPAGE) == 0;
+        }
+    }
+    block.base = base;
+    block.mapped_bytes = len;
+
+    // Placement has to be set before the first touch
+    vector<int> nodes = parseList("/sys/devices/system/node/online");
+    if (node >= 0) {
+        if (bindMemory(base, len, MPOL_BIND, vector<int>(1, node)))
+            block.node = node;
+    }
+    else if (config.numa != NUMA_LOCAL && nodes.size() > 1) {
+        block.interleaved = bindMemory(base, len, MPOL_INTERLEAVE, nodes);
+    }
+
+    if (config.touch_threads > 0)
+        touchMemory((char*)base, len, config.touch_threads);
+    return block;
+}
+
+void freeMemory(MemBlock& block) {
+    if (block.base != NULL) munmap(block.base, block.mapped_bytes);
+    block.base = NULL;
+    block.mapped_bytes = 0;
+}
+
+int getNumaNodeNum() {
+    vector<int> nodes = parseList("/sys/devices/system/node/online");
+    return max(1, (int)nodes.size());
+}
+
+static bool bindThread(const vector<int>& cpus) {
+    if (cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < cpus.size(); i++) {
+        if (cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool bindThreadToNode(int node) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    return bindThread(parseList(path));
+}
+
+bool unbindThread() {
+    return bindThread(parseList("/sys/devices/system/cpu/online"));
+}
+
+size_t getHugePageBytes(const MemBlock& block) {
+    if (block.base == NULL) return 0;
+    if (block.explicit_huge) return block.mapped_bytes;
+
+    // Sum AnonHugePages over the mappings overlapping the block
+    uintptr_t begin = (uintptr_t)block.base;
+    uintptr_t end = begin + block.mapped_bytes;
+    ifstream smaps("/proc/self/smaps");
+    string line;
+    bool inside = false;
+    size_t huge_kb = 0;
+    while (getline(smaps, line)) {
+        unsigned long map_begin, map_end;
+        if (sscanf(line.c_str(), "%lx-%lx ", &map_begin, &map_end) == 2 &&
+            line.find(':') > line.find(' ')) {
+            inside = map_begin < end && map_end > begin;
+        }
+        else if (inside && line.compare(0, 14, "AnonHugePages:") == 0) {
+            huge_kb += strtoul(line.c_str() + 14, NULL, 10);
+        }
+    }
+    return min(huge_kb * 1024, block.mapped_bytes);
+}
+
+string describeMemory(const MemBlock& block) {
+    ostringstream os;
+    os << (block.bytes >> 20) << " MB, ";
+    if (block.explicit_huge)
+        os << "explicit huge pages";
+    else if (block.transparent_huge)
+        os << "transparent huge pages (" << (getHugePageBytes(block) >> 20)
+           << " MB so far)";
+    else
+        os << "4 kB pages";
+    if (block.explicit_short) os << " as the hugetlb pool is short";
+    if (block.node >= 0)
+        os << ", bound to node " << block.node;
+    else if (block.interleaved)
+        os << ", interleaved over " << getNumaNodeNum() << " nodes";
+    else
+        os << ", first-touch placement";
+    return os.str();
+}
@@ -0,0 +1,72 @@
+#include <cstddef>
+#include <string>
+
+using namespace std;
+
+#ifndef __MEM_ALLOC__
+#define __MEM_ALLOC__
+
+/*
+Page size of the large arrays, the Bloom filter layers and the packed
+reference. Query probes land on random pages, so with 4 kB pages nearly
+every probe is a TLB miss. EXPLICIT_HUGE_PAGES takes 2 MB pages from the
+hugetlb pool (vm.nr_hugepages) and falls back to transparent huge pages
+when the pool is short.
+*/
+typedef enum HugePageMode {
+    NO_HUGE_PAGES,
+    TRANSPARENT_HUGE_PAGES,
+    EXPLICIT_HUGE_PAGES
+} HugePageMode;
+
+/*
+Placement of the large arrays on a multi-socket machine. NUMA_LOCAL leaves
+every page on the node that touches it first. NUMA_INTERLEAVE spreads the
+pages over all nodes, so every socket sees the same mix of local and
+remote probes. NUMA_REPLICATE interleaves while training, then gives each
+node a copy of the layers and the reference for the mapping threads
+running on it.
+*/
+typedef enum NumaMode { NUMA_LOCAL, NUMA_INTERLEAVE, NUMA_REPLICATE } NumaMode;
+
+typedef struct MemConfig {
+    HugePageMode huge_pages;
+    NumaMode numa;
+
+    // Threads zeroing the pages right after allocation, 0 leaves the
+    // page faults to the first use
+    int touch_threads;
+} MemConfig;
+
+// Anonymous mapping, and what the kernel actually granted for it
+typedef struct MemBlock {
+    void* base;
+    size_t bytes;
+    size_t mapped_bytes;
+    bool explicit_huge;
+    bool explicit_short;
+    bool transparent_huge;
+    bool interleaved;
+    int node;
+} MemBlock;
+
+// Zeroed memory aligned to 2 MB, exits if it cannot be mapped. A node of
+// -1 applies the NUMA mode of config, a node >= 0 binds to that node.
+MemBlock allocMemory(size_t, const MemConfig&, int);
+void freeMemory(MemBlock&);
+
+// Online NUMA nodes, 1 without NUMA support
+int getNumaNodeNum();
+
+// Restrict the calling thread to the CPUs of a node, or let it run on
+// every CPU again
+bool bindThreadToNode(int);
+bool unbindThread();
+
+// Bytes of the block backed by huge pages so far, from /proc/self/smaps
+size_t getHugePageBytes(const MemBlock&);
+
+// One line on what the block got, e.g. for the startup report
+string describeMemory(const MemBlock&);
+
+#endif
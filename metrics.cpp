@@ -0,0 +1,113 @@
+#include "metrics.h"
+
+#include <chrono>
+
+double Timer::now() {
+    return chrono::duration<double>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void Timer::reset() {
+    _duration = 0;
+    _start_time = 0;
+}
+
+void Timer::start() { _start_time = now(); }
+
+void Timer::pause() {
+    _duration += now() - _start_time;
+    _start_time = 0;
+}
+
+void Timer::add(double sec) { _duration += sec; }
+
+void Timer::add(const Timer& other) { _duration += other._duration; }
+
+double Timer::getSec() { return _duration; }
+
+LatencyHistogram::LatencyHistogram() { reset(); }
+
+void LatencyHistogram::reset() {
+    _buckets.assign(64 << LATENCY_SUB_BITS, 0);
+    _cnt = 0;
+    _max_ns = 0;
+}
+
+int LatencyHistogram::getBucket(uint64_t ns) {
+    // Values below 2^LATENCY_SUB_BITS get a bucket each
+    int sub_num = 1 << LATENCY_SUB_BITS;
+    if (ns < sub_num) return ns;
+    int exp = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (exp - LATENCY_SUB_BITS)) & (sub_num - 1);
+    return (exp - LATENCY_SUB_BITS + 1) * sub_num + sub;
+}
+
+uint64_t LatencyHistogram::getBucketEnd(int bucket) {
+    // First value of the next bucket
+    int sub_num = 1 << LATENCY_SUB_BITS;
+    int next = bucket + 1;
+    if (next < sub_num) return next;
+    int exp = next / sub_num + LATENCY_SUB_BITS - 1;
+    return (uint64_t)(sub_num + next % sub_num) << (exp - LATENCY_SUB_BITS);
+}
+
+void LatencyHistogram::add(double sec) {
+    uint64_t ns = sec > 0 ? sec * 1e9 : 0;
+    _buckets[getBucket(ns)]++;
+    _cnt++;
+    if (ns > _max_ns) _max_ns = ns;
+}
+
+void LatencyHistogram::add(const LatencyHistogram& other) {
+    for (int i = 0; i < _buckets.size(); i++) {
+        _buckets[i] += other._buckets[i];
+    }
+    _cnt += other._cnt;
+    if (other._max_ns > _max_ns) _max_ns = other._max_ns;
+}
+
+long LatencyHistogram::getCnt() { return _cnt; }
+
+double LatencyHistogram::getPercentile(double p) {
+    // Upper end of the bucket holding the p-th percentile, in seconds
+    if (_cnt == 0) return 0;
+    long rank = p / 100 * _cnt;
+    if (rank >= _cnt) rank = _cnt - 1;
+    long seen = 0;
+    for (int i = 0; i < _buckets.size(); i++) {
+        seen += _buckets[i];
+        if (seen > rank) return getBucketEnd(i) * 1e-9;
+    }
+    return getMax();
+}
+
+double LatencyHistogram::getMax() { return _max_ns * 1e-9; }
+
+void MapMetrics::reset(int layer_num) {
+    reads = 0;
+    layer_nodes.assign(layer_num, 0);
+    layer_probes.assign(layer_num, 0);
+    layer_satellite.assign(layer_num, 0);
+    layer_unmapped.assign(layer_num, 0);
+    no_seed = 0;
+    over_budget = 0;
+    latency.reset();
+    mapping.reset();
+    seed_extraction.reset();
+}
+
+void MapMetrics::add(const MapMetrics& other) {
+    reads += other.reads;
+    for (int i = 0; i < layer_nodes.size(); i++) {
+        layer_nodes[i] += other.layer_nodes[i];
+        layer_probes[i] += other.layer_probes[i];
+        layer_satellite[i] += other.layer_satellite[i];
+        layer_unmapped[i] += other.layer_unmapped[i];
+    }
+    no_seed += other.no_seed;
+    over_budget += other.over_budget;
+    latency.add(other.latency);
+    mapping.add(other.mapping);
+    seed_extraction.add(other.seed_extraction);
+}
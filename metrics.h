@@ -0,0 +1,81 @@
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+#ifndef __METRICS__
+#define __METRICS__
+
+class Timer {
+   private:
+    // Elapsed time on the monotonic clock. Timers of several threads can
+    // be summed after a parallel run, which gives thread-seconds.
+    double _duration;
+    double _start_time;
+
+   public:
+    static double now();
+    void reset();
+    void start();
+    void pause();
+    void add(double);
+    void add(const Timer&);
+    double getSec();
+};
+
+// Sub-buckets per power of two of a LatencyHistogram, as a power of two
+#define LATENCY_SUB_BITS 3
+
+/*
+Log-linear histogram of nanosecond latencies. Every power of two is split
+into 2^LATENCY_SUB_BITS buckets, so a percentile is off by at most 1/8.
+*/
+class LatencyHistogram {
+   private:
+    vector<long> _buckets;
+    long _cnt;
+    long _max_ns;
+
+    int getBucket(uint64_t);
+    uint64_t getBucketEnd(int);
+
+   public:
+    LatencyHistogram();
+    void reset();
+    void add(double);
+    void add(const LatencyHistogram&);
+    long getCnt();
+    double getPercentile(double);
+    double getMax();
+};
+
+// Per-thread metrics of mapRead(), merged once the threads are done
+struct MapMetrics {
+    long reads;
+
+    // Walk steps and seed queries made in each layer
+    vector<long> layer_nodes;
+    vector<long> layer_probes;
+
+    // Reads flagged as satellite in each layer, and unmapped reads whose
+    // walk did not get past each layer. Reads without a seed never walk.
+    vector<long> layer_satellite;
+    vector<long> layer_unmapped;
+    long no_seed;
+
+    // Reads whose walk ran out of its probe or CML budget
+    long over_budget;
+
+    // From the first walk step to the alignment of the read, which
+    // includes the steps of the reads walked at the same time
+    LatencyHistogram latency;
+
+    // Walking and aligning, and aligning alone
+    Timer mapping;
+    Timer seed_extraction;
+
+    void reset(int);
+    void add(const MapMetrics&);
+};
+
+#endif
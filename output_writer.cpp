@@ -0,0 +1,112 @@
+#include "output_writer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+
+OutputWriter::OutputWriter(string path, OutputFormat format,
+                           int producer_num) {
+    _path = path;
+    _format = format;
+    _fd = -1;
+    _rings = vector<OutputRing>(max(producer_num, 1));
+    for (int r = 0; r < _rings.size(); r++) {
+        _rings[r].head.store(0);
+        _rings[r].tail.store(0);
+    }
+    _done.store(false);
+    _bytes = 0;
+}
+
+OutputWriter::~OutputWriter() {
+    if (_writer.joinable()) finish();
+    if (_fd >= 0) ::close(_fd);
+}
+
+bool OutputWriter::open() {
+    _fd = ::open(_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0) return false;
+    _buf.reserve(2 * OUTPUT_BUFFER_SIZE);
+    return true;
+}
+
+void OutputWriter::flush() {
+    // One write() per buffer, the kernel may take it in several parts
+    long done = 0;
+    while (done < _buf.size()) {
+        ssize_t len = ::write(_fd, _buf.data() + done, _buf.size() - done);
+        if (len < 0) {
+            cerr << "[OutputWriter] Cannot write " << _path << endl;
+            exit(1);
+        }
+        done += len;
+    }
+    _bytes += _buf.size();
+    _buf.clear();
+}
+
+void OutputWriter::write(const string& text) {
+    // Header lines, before start()
+    _buf += text;
+}
+
+void OutputWriter::start() {
+    _writer = thread(&OutputWriter::writeWorker, this);
+}
+
+void OutputWriter::push(int producer, string& chunk) {
+    // Hand the chunk over, chunk is left empty
+    OutputRing& ring = _rings[producer];
+    long tail = ring.tail.load(memory_order_relaxed);
+    while (tail - ring.head.load(memory_order_acquire) == OUTPUT_RING_SIZE) {
+        this_thread::yield();
+    }
+    ring.slots[tail % OUTPUT_RING_SIZE].swap(chunk);
+    ring.tail.store(tail + 1, memory_order_release);
+}
+
+bool OutputWriter::drain() {
+    // Move every queued chunk to the buffer, returns false if none was
+    bool found = false;
+    for (int r = 0; r < _rings.size(); r++) {
+        OutputRing& ring = _rings[r];
+        long head = ring.head.load(memory_order_relaxed);
+        long tail = ring.tail.load(memory_order_acquire);
+        for (; head < tail; head++) {
+            string& slot = ring.slots[head % OUTPUT_RING_SIZE];
+            _buf += slot;
+            slot.clear();
+            ring.head.store(head + 1, memory_order_release);
+            if (_buf.size() >= OUTPUT_BUFFER_SIZE) flush();
+            found = true;
+        }
+    }
+    return found;
+}
+
+void OutputWriter::writeWorker() {
+    while (true) {
+        // Read _done first, so chunks pushed before it are drained
+        bool done = _done.load(memory_order_acquire);
+        if (drain()) continue;
+        if (done) break;
+        this_thread::sleep_for(chrono::microseconds(100));
+    }
+    flush();
+}
+
+void OutputWriter::finish() {
+    // Called once every producer is done pushing
+    if (!_writer.joinable()) {
+        flush();
+        return;
+    }
+    _done.store(true, memory_order_release);
+    _writer.join();
+}
+
+OutputFormat OutputWriter::getFormat() { return _format; }
+
+long OutputWriter::getBytes() { return _bytes; }
@@ -0,0 +1,69 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#ifndef __OUTPUT_WRITER__
+#define __OUTPUT_WRITER__
+
+// Per-read records of mapRead()
+typedef enum OutputFormat { SAM_FORMAT, PAF_FORMAT } OutputFormat;
+
+// Chunks a mapping thread can queue before it waits for the writer
+#define OUTPUT_RING_SIZE 16
+
+// Bytes collected before one write to the file
+#define OUTPUT_BUFFER_SIZE (4 << 20)
+
+/*
+Single-producer single-consumer ring of record chunks, one per mapping
+thread. The producer swaps a filled chunk into the slot at tail and gets
+back the cleared string of an earlier chunk, so buffers are reused and
+records are never copied on the mapping thread. The slots keep the
+counters of both threads on different cache lines.
+*/
+struct OutputRing {
+    atomic<long> head;
+    string slots[OUTPUT_RING_SIZE];
+    atomic<long> tail;
+};
+
+/*
+Writes the records of all mapping threads to one file from a dedicated
+thread. Mapping threads only block when their ring is full, which takes
+the writer falling OUTPUT_RING_SIZE batches behind. Records of different
+threads are interleaved by batch.
+*/
+class OutputWriter {
+   private:
+    string _path;
+    OutputFormat _format;
+    int _fd;
+
+    vector<OutputRing> _rings;
+    atomic<bool> _done;
+    thread _writer;
+
+    // Records waiting for the next write, and bytes written
+    string _buf;
+    long _bytes;
+
+    void flush();
+    bool drain();
+    void writeWorker();
+
+   public:
+    OutputWriter(string, OutputFormat, int);
+    ~OutputWriter();
+    bool open();
+    void write(const string&);
+    void start();
+    void push(int, string&);
+    void finish();
+    OutputFormat getFormat();
+    long getBytes();
+};
+
+#endif
@@ -0,0 +1,323 @@
+#include "packed_ref_seq.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+int8_t base_code[256];
+
+// Four unpacked characters and codes of each packed byte
+static char byte_bases[256][4];
+static int8_t byte_codes[256][4];
+
+static bool initTables() {
+    const char bases[] = "ACGT";
+    memset(base_code, -1, sizeof(base_code));
+    for (int i = 0; i < 4; i++) {
+        base_code[(uint8_t)bases[i]] = i;
+        base_code[(uint8_t)tolower(bases[i])] = i;
+    }
+    for (int b = 0; b < 256; b++) {
+        for (int k = 0; k < 4; k++) {
+            byte_bases[b][k] = bases[(b >> (2 * k)) & 3];
+            byte_codes[b][k] = (b >> (2 * k)) & 3;
+        }
+    }
+    return true;
+}
+
+static bool tables_ready = initTables();
+
+PackedRefSeq::PackedRefSeq(long size, const MemConfig& config) {
+    _size = size;
+    _len = 0;
+    _block = allocMemory((size + 3) / 4, config, -1);
+    _data = (uint8_t*)_block.base;
+    _own_data = true;
+}
+
+PackedRefSeq::~PackedRefSeq() {
+    if (_own_data) freeMemory(_block);
+}
+
+int PackedRefSeq::findRun(long pos) {
+    // Index of the first run that ends after pos
+    int lo = 0;
+    int hi = _ambiguous.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (_ambiguous[mid].begin + _ambiguous[mid].len <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void PackedRefSeq::addBreak(long begin, long end) {
+    /*
+    Insert [begin, end) into the break table, merged with the breaks it
+    overlaps or touches. The FASTA is loaded in order, so the new break
+    nearly always goes last.
+    */
+    if (_breaks.empty() || _breaks.back().end < begin) {
+        RefBreak brk = {begin, end};
+        _breaks.push_back(brk);
+        return;
+    }
+    if (_breaks.back().begin <= begin) {
+        _breaks.back().end = max(_breaks.back().end, end);
+        return;
+    }
+
+    // Breaks [lo, hi) touch the new one
+    int lo = findBreak(begin - 1);
+    int hi = lo;
+    while (hi < _breaks.size() && _breaks[hi].begin <= end) hi++;
+    if (lo == hi) {
+        RefBreak brk = {begin, end};
+        _breaks.insert(_breaks.begin() + lo, brk);
+        return;
+    }
+    _breaks[lo].begin = min(_breaks[lo].begin, begin);
+    _breaks[lo].end = max(_breaks[hi - 1].end, end);
+    _breaks.erase(_breaks.begin() + lo + 1, _breaks.begin() + hi);
+}
+
+void PackedRefSeq::append(char base) {
+    if (_len == _size) return;
+
+    int code = base_code[(uint8_t)base];
+    if (code < 0) {
+        // Extend the last run or start a new one
+        char upper = toupper(base);
+        if (!_ambiguous.empty() && _ambiguous.back().base == upper &&
+            _ambiguous.back().begin + _ambiguous.back().len == _len) {
+            _ambiguous.back().len += 1;
+        }
+        else {
+            AmbiguousRun run = {_len, 1, upper};
+            _ambiguous.push_back(run);
+        }
+        addBreak(_len, _len + 1);
+        code = 0;
+    }
+
+    // The first base of a byte overwrites it, so no zeroing is needed
+    if (_len % 4 == 0)
+        _data[_len / 4] = code;
+    else
+        _data[_len / 4] |= code << (2 * (_len % 4));
+    _len += 1;
+}
+
+void PackedRefSeq::append(const char* bases, long num) {
+    num = min(num, _size - _len);
+    long i = 0;
+    while (i < num) {
+        // Four ACGT bases on a byte boundary fill the byte at once
+        if (_len % 4 == 0 && i + 4 <= num) {
+            int8_t c0 = base_code[(uint8_t)bases[i]];
+            int8_t c1 = base_code[(uint8_t)bases[i + 1]];
+            int8_t c2 = base_code[(uint8_t)bases[i + 2]];
+            int8_t c3 = base_code[(uint8_t)bases[i + 3]];
+            if ((c0 | c1 | c2 | c3) >= 0) {
+                _data[_len / 4] = c0 | (c1 << 2) | (c2 << 4) | (c3 << 6);
+                _len += 4;
+                i += 4;
+                continue;
+            }
+        }
+        append(bases[i]);
+        i += 1;
+    }
+}
+
+char PackedRefSeq::get(long pos) {
+    int run = findRun(pos);
+    if (run < _ambiguous.size() && _ambiguous[run].begin <= pos) {
+        return _ambiguous[run].base;
+    }
+    return byte_bases[_data[pos / 4]][pos % 4];
+}
+
+bool PackedRefSeq::isAmbiguous(long pos, long& run_begin) {
+    int run = findRun(pos);
+    if (run < _ambiguous.size() && _ambiguous[run].begin <= pos) {
+        run_begin = _ambiguous[run].begin;
+        return true;
+    }
+    return false;
+}
+
+void PackedRefSeq::extract(long loc, long len, string& out) {
+    /*
+    Unpack bases [loc, loc + len) into out. The window is clipped at the
+    end of the reference.
+    */
+    len = max(0L, min(len, _len - loc));
+    out.resize(len);
+    if (len == 0) return;
+
+    char* dst = &out[0];
+    long pos = loc;
+    long end = loc + len;
+
+    // Leading bases up to a byte boundary
+    while (pos < end && pos % 4 != 0) {
+        *dst++ = byte_bases[_data[pos / 4]][pos % 4];
+        pos += 1;
+    }
+
+    // Whole bytes
+    while (pos + 4 <= end) {
+        memcpy(dst, byte_bases[_data[pos / 4]], 4);
+        dst += 4;
+        pos += 4;
+    }
+
+    // Trailing bases
+    while (pos < end) {
+        *dst++ = byte_bases[_data[pos / 4]][pos % 4];
+        pos += 1;
+    }
+
+    // Restore ambiguous bases inside the window
+    for (int run = findRun(loc);
+         run < _ambiguous.size() && _ambiguous[run].begin < end; run++) {
+        long run_begin = max(_ambiguous[run].begin, loc);
+        long run_end = min(_ambiguous[run].begin + _ambiguous[run].len, end);
+        memset(&out[run_begin - loc], _ambiguous[run].base,
+               run_end - run_begin);
+    }
+}
+
+void PackedRefSeq::extractCodes(long loc, long len, vector<int8_t>& out) {
+    /*
+    Like extract(), but each base is its 2-bit code and ambiguous bases
+    are -1.
+    */
+    len = max(0L, min(len, _len - loc));
+    out.resize(len);
+    if (len == 0) return;
+
+    int8_t* dst = &out[0];
+    long pos = loc;
+    long end = loc + len;
+    while (pos < end && pos % 4 != 0) {
+        *dst++ = byte_codes[_data[pos / 4]][pos % 4];
+        pos += 1;
+    }
+    while (pos + 4 <= end) {
+        memcpy(dst, byte_codes[_data[pos / 4]], 4);
+        dst += 4;
+        pos += 4;
+    }
+    while (pos < end) {
+        *dst++ = byte_codes[_data[pos / 4]][pos % 4];
+        pos += 1;
+    }
+
+    for (int run = findRun(loc);
+         run < _ambiguous.size() && _ambiguous[run].begin < end; run++) {
+        long run_begin = max(_ambiguous[run].begin, loc);
+        long run_end = min(_ambiguous[run].begin + _ambiguous[run].len, end);
+        memset(&out[run_begin - loc], -1, run_end - run_begin);
+    }
+}
+
+long PackedRefSeq::getLen() { return _len; }
+
+long PackedRefSeq::getAmbiguousLen() {
+    long sum = 0;
+    for (int i = 0; i < _ambiguous.size(); i++) {
+        sum += _ambiguous[i].len;
+    }
+    return sum;
+}
+
+void PackedRefSeq::attach(uint8_t* data, long len, const AmbiguousRun* runs,
+                          long run_num) {
+    // Use packed bases owned by someone else, e.g. a mapped index file.
+    // The run table is small, so it is copied.
+    if (_own_data) freeMemory(_block);
+    _data = data;
+    _own_data = false;
+    _size = len;
+    _len = len;
+    _ambiguous.assign(runs, runs + run_num);
+    _breaks.clear();
+    for (long i = 0; i < run_num; i++) {
+        addBreak(runs[i].begin, runs[i].begin + runs[i].len);
+    }
+}
+
+PackedRefSeq* PackedRefSeq::replicate(const MemConfig& config, int node) {
+    // Copy of the bases in memory bound to node, with the same tables.
+    // The copy touches every page.
+    MemConfig copy_config = config;
+    copy_config.touch_threads = 0;
+    PackedRefSeq* copy = new PackedRefSeq(0, copy_config);
+    copy->_block = allocMemory(getDataBytes(), copy_config, node);
+    copy->_data = (uint8_t*)copy->_block.base;
+    memcpy(copy->_data, _data, getDataBytes());
+    copy->_size = _len;
+    copy->_len = _len;
+    copy->_ambiguous = _ambiguous;
+    copy->_contigs = _contigs;
+    copy->_breaks = _breaks;
+    return copy;
+}
+
+const MemBlock& PackedRefSeq::getBlock() { return _block; }
+
+uint8_t* PackedRefSeq::getData() { return _data; }
+
+long PackedRefSeq::getDataBytes() { return (_len + 3) / 4; }
+
+const vector<AmbiguousRun>& PackedRefSeq::getAmbiguous() { return _ambiguous; }
+
+void PackedRefSeq::addContig(const string& name, long begin) {
+    Contig contig = {name, begin};
+    _contigs.push_back(contig);
+
+    // No seed of the reference starts before base 0
+    if (begin > 0) addBreak(begin, begin);
+}
+
+const vector<Contig>& PackedRefSeq::getContigs() { return _contigs; }
+
+int PackedRefSeq::findContig(long pos) {
+    // Index of the last contig starting at or before pos, -1 if none
+    int lo = 0;
+    int hi = _contigs.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (_contigs[mid].begin <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+long PackedRefSeq::getContigLen(int contig) {
+    long end = contig + 1 < _contigs.size() ? _contigs[contig + 1].begin : _len;
+    return end - _contigs[contig].begin;
+}
+
+const vector<RefBreak>& PackedRefSeq::getBreaks() { return _breaks; }
+
+int PackedRefSeq::findBreak(long pos) {
+    // Index of the first break that ends after pos
+    int lo = 0;
+    int hi = _breaks.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (_breaks[mid].end <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
@@ -0,0 +1,104 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mem_alloc.h"
+
+using namespace std;
+
+#ifndef __PACKED_REF_SEQ__
+#define __PACKED_REF_SEQ__
+
+// 2-bit code of each character, -1 for non-ACGT
+extern int8_t base_code[256];
+
+// Complement of an upper case base, other characters are kept
+inline char complementBase(char base) {
+    switch (base) {
+        case 'A': return 'T';
+        case 'C': return 'G';
+        case 'G': return 'C';
+        case 'T': return 'A';
+        default: return base;
+    }
+}
+
+inline void reverseComplement(const string& seq, string& rc) {
+    rc.resize(seq.size());
+    for (long i = 0; i < seq.size(); i++) {
+        rc[i] = complementBase(seq[seq.size() - 1 - i]);
+    }
+}
+
+// Run of identical non-ACGT bases, e.g. a gap of N
+typedef struct AmbiguousRun {
+    long begin;
+    long len;
+    char base;
+} AmbiguousRun;
+
+// Stretch no seed may span: a run of ambiguous bases, or the empty
+// interval at the start of a contig. Seeds ending at base p cross the
+// break when they start before end and begin <= p.
+typedef struct RefBreak {
+    long begin;
+    long end;
+} RefBreak;
+
+// Record of the reference FASTA, its bases start at base begin and end
+// where the next record starts
+typedef struct Contig {
+    string name;
+    long begin;
+} Contig;
+
+class PackedRefSeq {
+   private:
+    // Capacity and number of stored bases
+    long _size;
+    long _len;
+
+    // 2-bit packed bases, base i is stored in byte i / 4 at bit 2 * (i % 4).
+    // A = 0, C = 1, G = 2, T = 3. Ambiguous bases are stored as A.
+    uint8_t* _data;
+    bool _own_data;
+    MemBlock _block;
+
+    // Sorted runs of ambiguous bases
+    vector<AmbiguousRun> _ambiguous;
+
+    // Records in the order of the FASTA
+    vector<Contig> _contigs;
+
+    // Sorted, disjoint breaks of both tables above
+    vector<RefBreak> _breaks;
+
+    int findRun(long);
+    void addBreak(long, long);
+
+   public:
+    PackedRefSeq(long, const MemConfig&);
+    ~PackedRefSeq();
+    void append(char);
+    void append(const char*, long);
+    char get(long);
+    bool isAmbiguous(long, long&);
+    void extract(long, long, string&);
+    void extractCodes(long, long, vector<int8_t>&);
+    long getLen();
+    long getAmbiguousLen();
+    void attach(uint8_t*, long, const AmbiguousRun*, long);
+    PackedRefSeq* replicate(const MemConfig&, int);
+    const MemBlock& getBlock();
+    uint8_t* getData();
+    long getDataBytes();
+    const vector<AmbiguousRun>& getAmbiguous();
+    void addContig(const string&, long);
+    const vector<Contig>& getContigs();
+    int findContig(long);
+    long getContigLen(int);
+    const vector<RefBreak>& getBreaks();
+    int findBreak(long);
+};
+
+#endif
@@ -0,0 +1,324 @@
+#include "read_source.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cstring>
+#include <iostream>
+
+ReadSource::ReadSource(string path, int batch_num) {
+    _path = path;
+    _format = ALN_FORMAT;
+    _data = NULL;
+    _size = 0;
+    _pos = 0;
+    _read_cnt = 0;
+    _done = false;
+
+    _batches.resize(max(batch_num, 2));
+    for (int b = 0; b < _batches.size(); b++) {
+        _batches[b].reads.reserve(READ_BATCH_SIZE);
+        _free.push_back(&_batches[b]);
+    }
+}
+
+ReadSource::~ReadSource() {
+    if (_parser.joinable()) _parser.join();
+    if (_data != NULL) munmap(_data, _size);
+}
+
+bool ReadSource::open() {
+    int fd = ::open(_path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    fstat(fd, &st);
+    _size = st.st_size;
+    if (_size > 0) {
+        void* base = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            cerr << "[ReadSource] Cannot map " << _path << endl;
+            exit(1);
+        }
+        _data = (char*)base;
+        madvise(_data, _size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    // Tell the format by the first character
+    const char* line;
+    long len;
+    if (_size > 0 && _data[0] == '#') {
+        _format = ALN_FORMAT;
+        while (nextLine(line, len)) {
+            if (len == 12 && memcmp(line, "##Header End", 12) == 0) break;
+
+            // @SQ <contig name> <contig length>
+            if (len < 4 || memcmp(line, "@SQ", 3) != 0 || !isspace(line[3]))
+                continue;
+            long i = 3;
+            while (i < len && isspace(line[i])) i++;
+            long name_begin = i;
+            while (i < len && !isspace(line[i])) i++;
+            string name(line + name_begin, i - name_begin);
+            while (i < len && isspace(line[i])) i++;
+            long contig_len = 0;
+            for (; i < len && isdigit(line[i]); i++) {
+                contig_len = contig_len * 10 + (line[i] - '0');
+            }
+            _contig_lens.push_back(make_pair(name, contig_len));
+        }
+    }
+    else if (_size > 0 && _data[0] == '@') {
+        _format = FASTQ_FORMAT;
+    }
+    else {
+        _format = FASTA_FORMAT;
+    }
+    return true;
+}
+
+bool ReadSource::nextLine(const char*& line, long& len) {
+    // Next line without its line break, false at the end of the file
+    if (_pos >= _size) return false;
+    line = _data + _pos;
+    const char* eol = (const char*)memchr(line, '\n', _size - _pos);
+    len = eol ? eol - line : _size - _pos;
+    _pos += len + 1;
+    if (len > 0 && line[len - 1] == '\r') len -= 1;
+    return true;
+}
+
+long ReadSource::contigLen(const char* name, long name_len) {
+    // Length of the contig from the ALN header, -1 if it is not there
+    for (int c = 0; c < _contig_lens.size(); c++) {
+        const string& contig = _contig_lens[c].first;
+        if (contig.size() == name_len &&
+            memcmp(contig.data(), name, name_len) == 0)
+            return _contig_lens[c].second;
+    }
+    return -1;
+}
+
+bool ReadSource::parseAln(Read& read, ReadBatch& batch, long& buf_offset) {
+    /* Read format:
+    >chr1  chr1-1536540  116446253  -
+    <Original sequence>
+    <Simulater generated sequence>
+
+    Both sequences are aligned, '-' marks the gaps. A read with gaps is
+    copied without them into the batch buffer at buf_offset.
+
+    A '-' read is aligned to the reverse complemented contig, and its
+    location counts from the start of that. On the forward strand the
+    read starts at contig length - location - reference bases covered.
+    */
+    const char* line;
+    long len;
+    buf_offset = -1;
+    while (nextLine(line, len)) {
+        if (len == 0 || line[0] != '>') continue;
+
+        // Reference name, read name, golden location, forward/reverse
+        const char* tokens[4];
+        long token_lens[4];
+        int token_num = 0;
+        long i = 0;
+        while (token_num < 4) {
+            while (i < len && isspace(line[i])) i++;
+            if (i == len) break;
+            tokens[token_num] = line + i;
+            while (i < len && !isspace(line[i])) i++;
+            token_lens[token_num] = line + i - tokens[token_num];
+            token_num++;
+        }
+
+        const char* ref;
+        long ref_len;
+        const char* seq;
+        long seq_len;
+        if (!nextLine(ref, ref_len)) return false;  // Original sequence
+        if (!nextLine(seq, seq_len)) return false;  // Generated sequence
+        if (token_num < 4) continue;
+
+        long golden_loc = 0;
+        for (long d = 0; d < token_lens[2]; d++) {
+            golden_loc = golden_loc * 10 + (tokens[2][d] - '0');
+        }
+        if (tokens[3][0] == '-') {
+            // The reference name follows the '>'
+            long contig_len = contigLen(tokens[0] + 1, token_lens[0] - 1);
+            if (contig_len < 0) {
+                cerr << "[parseAln] No @SQ line for "
+                     << string(tokens[0] + 1, token_lens[0] - 1) << endl;
+                exit(1);
+            }
+            long ref_span = 0;
+            for (long d = 0; d < ref_len; d++) {
+                if (ref[d] != '-') ref_span++;
+            }
+            golden_loc = contig_len - golden_loc - ref_span;
+        }
+
+        read.name = tokens[1];
+        read.name_len = token_lens[1];
+        read.seq = seq;
+        read.seq_len = seq_len;
+        read.golden_contig = tokens[0] + 1;
+        read.golden_contig_len = token_lens[0] - 1;
+        read.golden_loc = golden_loc;
+
+        if (memchr(seq, '-', seq_len) != NULL) {
+            buf_offset = batch.buf.size();
+            for (long d = 0; d < seq_len; d++) {
+                if (seq[d] != '-') batch.buf.push_back(seq[d]);
+            }
+            read.seq = NULL;
+            read.seq_len = batch.buf.size() - buf_offset;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool ReadSource::parseFastq(Read& read) {
+    // @name, sequence, +, quality
+    const char* line;
+    long len;
+    while (nextLine(line, len)) {
+        if (len == 0 || line[0] != '@') continue;
+        read.name = line + 1;
+        read.name_len = len - 1;
+        for (int i = 1; i < read.name_len; i++) {
+            if (isspace(read.name[i])) read.name_len = i;
+        }
+
+        if (!nextLine(line, len)) return false;
+        read.seq = line;
+        read.seq_len = len;
+        read.golden_contig = NULL;
+        read.golden_contig_len = 0;
+        read.golden_loc = NO_GOLDEN_LOC;
+        nextLine(line, len);
+        nextLine(line, len);
+        return true;
+    }
+    return false;
+}
+
+bool ReadSource::parseFasta(Read& read, ReadBatch& batch, long& buf_offset) {
+    /*
+    >name, then sequence lines up to the next record. A single line is
+    used in place, several lines are joined in the batch buffer at
+    buf_offset.
+    */
+    const char* line;
+    long len;
+    while (nextLine(line, len)) {
+        if (len == 0 || line[0] != '>') continue;
+        read.name = line + 1;
+        read.name_len = len - 1;
+        for (int i = 1; i < read.name_len; i++) {
+            if (isspace(read.name[i])) read.name_len = i;
+        }
+        read.seq = NULL;
+        read.seq_len = 0;
+        read.golden_contig = NULL;
+        read.golden_contig_len = 0;
+        read.golden_loc = NO_GOLDEN_LOC;
+        buf_offset = -1;
+
+        while (_pos < _size && _data[_pos] != '>') {
+            nextLine(line, len);
+            if (len == 0) continue;
+            if (read.seq_len == 0) {
+                read.seq = line;
+            }
+            else {
+                if (buf_offset < 0) {
+                    buf_offset = batch.buf.size();
+                    batch.buf.insert(batch.buf.end(), read.seq,
+                                     read.seq + read.seq_len);
+                }
+                batch.buf.insert(batch.buf.end(), line, line + len);
+            }
+            read.seq_len += len;
+        }
+        return true;
+    }
+    return false;
+}
+
+void ReadSource::parseWorker() {
+    vector<pair<int, long> > joined;
+    while (true) {
+        ReadBatch* batch;
+        {
+            unique_lock<mutex> lock(_mutex);
+            _free_cv.wait(lock, [this] { return !_free.empty(); });
+            batch = _free.front();
+            _free.pop_front();
+        }
+
+        batch->reads.clear();
+        batch->buf.clear();
+        joined.clear();
+        Read read;
+        bool more = true;
+        while (more && batch->reads.size() < READ_BATCH_SIZE) {
+            long buf_offset = -1;
+            if (_format == ALN_FORMAT)
+                more = parseAln(read, *batch, buf_offset);
+            else if (_format == FASTQ_FORMAT)
+                more = parseFastq(read);
+            else
+                more = parseFasta(read, *batch, buf_offset);
+            if (!more) break;
+            if (buf_offset >= 0)
+                joined.push_back(make_pair(batch->reads.size(), buf_offset));
+            batch->reads.push_back(read);
+        }
+        // The batch buffer has stopped growing, point at it
+        for (int j = 0; j < joined.size(); j++) {
+            batch->reads[joined[j].first].seq = &batch->buf[joined[j].second];
+        }
+
+        unique_lock<mutex> lock(_mutex);
+        _read_cnt += batch->reads.size();
+        if (batch->reads.empty())
+            _free.push_back(batch);
+        else
+            _ready.push_back(batch);
+        if (!more) _done = true;
+        _ready_cv.notify_all();
+        if (_done) break;
+    }
+}
+
+void ReadSource::start() { _parser = thread(&ReadSource::parseWorker, this); }
+
+ReadBatch* ReadSource::nextBatch() {
+    // Next parsed batch, NULL once the file is exhausted
+    unique_lock<mutex> lock(_mutex);
+    _ready_cv.wait(lock, [this] { return !_ready.empty() || _done; });
+    if (_ready.empty()) return NULL;
+    ReadBatch* batch = _ready.front();
+    _ready.pop_front();
+    return batch;
+}
+
+void ReadSource::releaseBatch(ReadBatch* batch) {
+    unique_lock<mutex> lock(_mutex);
+    _free.push_back(batch);
+    _free_cv.notify_one();
+}
+
+ReadFormat ReadSource::getFormat() { return _format; }
+
+long ReadSource::getReadCnt() {
+    unique_lock<mutex> lock(_mutex);
+    return _read_cnt;
+}
@@ -0,0 +1,86 @@
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#ifndef __READ_SOURCE__
+#define __READ_SOURCE__
+
+// ALN is the ART simulator output, the only format with golden locations
+typedef enum ReadFormat { ALN_FORMAT, FASTQ_FORMAT, FASTA_FORMAT } ReadFormat;
+
+// Reads handed to a mapping thread at a time
+#define READ_BATCH_SIZE 256
+
+// Golden location of reads without one
+#define NO_GOLDEN_LOC -1
+
+// Read parsed from the read file. The name and the sequence point into
+// the mapped file, or into the batch buffer for multi-line FASTA. The
+// golden location is the forward strand offset in the golden contig.
+typedef struct Read {
+    const char* name;
+    int name_len;
+    const char* seq;
+    int seq_len;
+    const char* golden_contig;
+    int golden_contig_len;
+    long golden_loc;
+} Read;
+
+typedef struct ReadBatch {
+    vector<Read> reads;
+    vector<char> buf;
+} ReadBatch;
+
+class ReadSource {
+   private:
+    string _path;
+    ReadFormat _format;
+    char* _data;
+    long _size;
+    long _pos;
+    long _read_cnt;
+
+    // Contig lengths from the @SQ lines of an ALN header. ART counts the
+    // location of a reverse strand read on the reverse complemented contig.
+    vector<pair<string, long> > _contig_lens;
+
+    /*
+    Batches cycle from _free to the parser thread, to _ready, to a mapping
+    thread and back to _free. With two batches per mapping thread, the
+    parser fills the next batch of a thread while it maps the current one.
+    */
+    vector<ReadBatch> _batches;
+    deque<ReadBatch*> _free;
+    deque<ReadBatch*> _ready;
+    bool _done;
+    mutex _mutex;
+    condition_variable _free_cv;
+    condition_variable _ready_cv;
+    thread _parser;
+
+    bool nextLine(const char*&, long&);
+    long contigLen(const char*, long);
+    bool parseAln(Read&, ReadBatch&, long&);
+    bool parseFastq(Read&);
+    bool parseFasta(Read&, ReadBatch&, long&);
+    void parseWorker();
+
+   public:
+    ReadSource(string, int);
+    ~ReadSource();
+    bool open();
+    void start();
+    ReadBatch* nextBatch();
+    void releaseBatch(ReadBatch*);
+    ReadFormat getFormat();
+    long getReadCnt();
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include "seed_counter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+SeedCounter::SeedCounter(SeedCountMode mode, int seed_len, long threshold,
+                         long seed_num, int thread_num) {
+    _mode = mode;
+    _seed_len = seed_len;
+    _threshold = threshold;
+    _thread_num = max(thread_num, 1);
+    _pass_num = 1;
+    _pass = 0;
+    _peak_pass_bytes = 0;
+    _idx_shift = 0;
+    _sketch = NULL;
+    _sketch_width = 0;
+
+    if (_mode == EXACT_COUNT) {
+        // Enough passes to keep the buffered seeds of a pass in budget
+        long seed_bytes = seed_num * (long)sizeof(uint64_t);
+        _pass_num = max(1L, (seed_bytes + SEED_PASS_BYTES - 1) / SEED_PASS_BYTES);
+        _pass_seeds.resize(_thread_num);
+        for (int t = 0; t < _thread_num; t++) {
+            _pass_seeds[t].resize(_thread_num);
+        }
+        _idx_shift = max(0, 2 * _seed_len - 16);
+        _frequent_idx.assign((1L << (2 * _seed_len - _idx_shift)) + 1, 0);
+    }
+    else {
+        // Counters stop one past the threshold, which must fit 8 bits
+        if (_threshold > 254) {
+            cerr << "[SeedCounter] Threshold " << _threshold
+                 << " does not fit the 8-bit sketch counters" << endl;
+            exit(1);
+        }
+        _sketch_width = 1024;
+        while (_sketch_width < seed_num / 2 && _sketch_width < SKETCH_MAX_WIDTH)
+            _sketch_width <<= 1;
+        _sketch = new uint8_t[SKETCH_DEPTH * _sketch_width];
+        memset(_sketch, 0, SKETCH_DEPTH * _sketch_width);
+    }
+}
+
+SeedCounter::~SeedCounter() { delete[] _sketch; }
+
+uint64_t SeedCounter::hashSeed(uint64_t seed, int row) {
+    // splitmix64 finalizer, one stream per sketch row
+    uint64_t h = seed + (row + 1) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+int SeedCounter::getPassNum() { return _pass_num; }
+
+void SeedCounter::startPass(int pass) { _pass = pass; }
+
+void SeedCounter::add(uint64_t seed, int thread_id) {
+    if (_mode == EXACT_COUNT) {
+        // The high half of the hash picks the pass, the low half the bucket
+        uint64_t h = hashSeed(seed, 0);
+        if ((long)((h >> 32) % _pass_num) != _pass) return;
+        _pass_seeds[thread_id][(h & 0xffffffff) % _thread_num].push_back(seed);
+        return;
+    }
+
+    for (int r = 0; r < SKETCH_DEPTH; r++) {
+        uint8_t* cnt =
+            &_sketch[r * _sketch_width + (hashSeed(seed, r) & (_sketch_width - 1))];
+        uint8_t old = *cnt;
+        while (old <= _threshold) {
+            uint8_t seen = __sync_val_compare_and_swap(cnt, old, old + 1);
+            if (seen == old) break;
+            old = seen;
+        }
+    }
+}
+
+void SeedCounter::countBucket(int bucket, vector<uint64_t>& frequent) {
+    // Gather the bucket from every adding thread, then sort and count
+    vector<uint64_t> seeds;
+    for (int t = 0; t < _thread_num; t++) {
+        vector<uint64_t>& part = _pass_seeds[t][bucket];
+        seeds.insert(seeds.end(), part.begin(), part.end());
+        vector<uint64_t>().swap(part);
+    }
+    sort(seeds.begin(), seeds.end());
+
+    long run_begin = 0;
+    for (long i = 1; i <= (long)seeds.size(); i++) {
+        if (i < seeds.size() && seeds[i] == seeds[run_begin]) continue;
+        if (i - run_begin > _threshold) frequent.push_back(seeds[run_begin]);
+        run_begin = i;
+    }
+}
+
+void SeedCounter::finishPass() {
+    if (_mode != EXACT_COUNT) return;
+
+    long pass_bytes = 0;
+    for (int t = 0; t < _thread_num; t++) {
+        for (int b = 0; b < _thread_num; b++) {
+            pass_bytes += _pass_seeds[t][b].capacity() * sizeof(uint64_t);
+        }
+    }
+    _peak_pass_bytes = max(_peak_pass_bytes, pass_bytes);
+
+    vector<vector<uint64_t> > frequent(_thread_num);
+    vector<thread> workers;
+    for (int b = 0; b < _thread_num; b++) {
+        workers.push_back(thread(&SeedCounter::countBucket, this, b,
+                                 ref(frequent[b])));
+    }
+    for (int b = 0; b < _thread_num; b++) {
+        workers[b].join();
+        _frequent.insert(_frequent.end(), frequent[b].begin(),
+                         frequent[b].end());
+    }
+
+    if (_pass < _pass_num - 1) return;
+
+    // All passes are in, index the frequent seeds by their top bits
+    sort(_frequent.begin(), _frequent.end());
+    long idx_num = _frequent_idx.size() - 1;
+    long i = 0;
+    for (long top = 0; top <= idx_num; top++) {
+        while (i < _frequent.size() && (long)(_frequent[i] >> _idx_shift) < top)
+            i++;
+        _frequent_idx[top] = i;
+    }
+}
+
+bool SeedCounter::isFrequent(uint64_t seed) {
+    if (_mode == EXACT_COUNT) {
+        long top = seed >> _idx_shift;
+        return binary_search(_frequent.begin() + _frequent_idx[top],
+                             _frequent.begin() + _frequent_idx[top + 1], seed);
+    }
+
+    for (int r = 0; r < SKETCH_DEPTH; r++) {
+        uint8_t cnt =
+            _sketch[r * _sketch_width + (hashSeed(seed, r) & (_sketch_width - 1))];
+        if (cnt <= _threshold) return false;
+    }
+    return true;
+}
+
+long SeedCounter::getFrequentNum() {
+    if (_mode == EXACT_COUNT) return _frequent.size();
+    return -1;
+}
+
+long SeedCounter::getMemSize() {
+    if (_mode == EXACT_COUNT) {
+        return _peak_pass_bytes + _frequent.capacity() * sizeof(uint64_t) +
+               _frequent_idx.size() * sizeof(long);
+    }
+    return SKETCH_DEPTH * _sketch_width;
+}
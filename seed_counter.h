@@ -0,0 +1,62 @@
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+#ifndef __SEED_COUNTER__
+#define __SEED_COUNTER__
+
+/*
+EXACT_COUNT sorts and counts the seeds, a hash partition of them per pass,
+and keeps the frequent ones. SKETCH_COUNT adds them to a count-min sketch
+of saturating 8-bit counters, which never underestimates a count.
+*/
+typedef enum SeedCountMode { EXACT_COUNT, SKETCH_COUNT } SeedCountMode;
+
+// Seeds buffered by one EXACT_COUNT pass, 8 bytes each
+#define SEED_PASS_BYTES (1L << 30)
+
+// Count-min sketch rows, and the largest row in bytes
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX_WIDTH (1L << 29)
+
+class SeedCounter {
+   private:
+    SeedCountMode _mode;
+    int _seed_len;
+    long _threshold;
+    int _thread_num;
+
+    // EXACT_COUNT: seeds of the current pass, by adding thread and bucket.
+    // Bucket b of all threads is sorted and counted by thread b.
+    int _pass_num;
+    int _pass;
+    vector<vector<vector<uint64_t> > > _pass_seeds;
+    long _peak_pass_bytes;
+
+    // Sorted seeds seen more than _threshold times, indexed by their top
+    // bits
+    vector<uint64_t> _frequent;
+    vector<long> _frequent_idx;
+    int _idx_shift;
+
+    // SKETCH_COUNT: SKETCH_DEPTH rows of _sketch_width counters
+    uint8_t* _sketch;
+    long _sketch_width;
+
+    uint64_t hashSeed(uint64_t, int);
+    void countBucket(int, vector<uint64_t>&);
+
+   public:
+    SeedCounter(SeedCountMode, int, long, long, int);
+    ~SeedCounter();
+    int getPassNum();
+    void startPass(int);
+    void add(uint64_t, int);
+    void finishPass();
+    bool isFrequent(uint64_t);
+    long getFrequentNum();
+    long getMemSize();
+};
+
+#endif
@@ -0,0 +1,137 @@
+#include "seed_selector.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+SeedSelector::SeedSelector(SeedSelectMode mode, int seed_len, int param) {
+    _mode = mode;
+    _seed_len = seed_len;
+    _param = param;
+
+    bool valid;
+    if (_mode == MINIMIZER_SEEDS)
+        valid = _param >= 1;
+    else if (_mode == SYNCMER_SEEDS)
+        valid = _param >= 1 && _param <= _seed_len;
+    else
+        valid = _param >= 1;
+    if (!valid) {
+        cerr << "[SeedSelector] Invalid parameter " << _param << endl;
+        exit(1);
+    }
+
+    _smer_mask = 0;
+    if (_mode == SYNCMER_SEEDS) {
+        for (int i = 0; i < _param; i++) {
+            _smer_mask = (_smer_mask << 2) | 3;
+        }
+    }
+}
+
+uint64_t SeedSelector::hashSeed(uint64_t seed) {
+    // splitmix64 finalizer, so that poly-A is not always the smallest
+    uint64_t h = seed + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+SeedSelectMode SeedSelector::getMode() { return _mode; }
+
+int SeedSelector::getParam() { return _param; }
+
+bool SeedSelector::isSampled() {
+    // Whether training only keeps the selected seeds
+    return _mode != STRIDE_SEEDS;
+}
+
+long SeedSelector::getContext() {
+    // Neighbouring seeds on each side that decide whether a seed is kept
+    return _mode == MINIMIZER_SEEDS ? _param - 1 : 0;
+}
+
+bool SeedSelector::isSyncmer(uint64_t seed) {
+    // The s-mer at position j starts at base j of the seed
+    int last = _seed_len - _param;
+    int min_pos = 0;
+    uint64_t min_hash = UINT64_MAX;
+    for (int j = 0; j <= last; j++) {
+        uint64_t h = hashSeed((seed >> (2 * (last - j))) & _smer_mask);
+        if (h < min_hash) {
+            min_hash = h;
+            min_pos = j;
+        }
+    }
+    return min_pos == 0 || min_pos == last;
+}
+
+void SeedSelector::selectMinimizers(const vector<uint64_t>& seeds, long begin,
+                                    long end, vector<uint8_t>& keep) {
+    /*
+    A seed is kept if it is the minimum of a window containing it. Every
+    window minimum is at most the seed hash, so that holds exactly when
+    the seed hash equals the largest minimum of its windows. Both are
+    sliding extrema, and neither depends on the direction of the scan.
+    */
+    long n = seeds.size();
+    long w = _param;
+    if (n < w) return;
+
+    _hash.resize(n);
+    for (long i = 0; i < n; i++) {
+        _hash[i] = hashSeed(seeds[i]);
+    }
+
+    // Minimum of window j, which covers seeds [j, j + w)
+    long window_num = n - w + 1;
+    _window_min.resize(window_num);
+    _deque.resize(n);
+    long head = 0;
+    long tail = 0;
+    for (long i = 0; i < n; i++) {
+        while (tail > head && _hash[_deque[tail - 1]] >= _hash[i]) tail--;
+        _deque[tail++] = i;
+        if (_deque[head] <= i - w) head++;
+        if (i >= w - 1) _window_min[i - w + 1] = _hash[_deque[head]];
+    }
+
+    // Largest minimum over the windows [i - w + 1, i] that exist
+    head = 0;
+    tail = 0;
+    long next_window = 0;
+    for (long i = 0; i < end; i++) {
+        long last_window = min(i, window_num - 1);
+        for (; next_window <= last_window; next_window++) {
+            while (tail > head &&
+                   _window_min[_deque[tail - 1]] <= _window_min[next_window])
+                tail--;
+            _deque[tail++] = next_window;
+        }
+        while (_deque[head] < i - w + 1) head++;
+        if (i >= begin) keep[i] = _hash[i] == _window_min[_deque[head]];
+    }
+}
+
+void SeedSelector::select(const vector<uint64_t>& seeds, long begin, long end,
+                          vector<uint8_t>& keep) {
+    /*
+    Mark which of seeds[begin, end) are selected in keep. Seeds outside
+    of the range only give context, keep is not set for them.
+    */
+    keep.assign(seeds.size(), 0);
+
+    if (_mode == STRIDE_SEEDS) {
+        for (long i = begin; i < end; i += _param) {
+            keep[i] = 1;
+        }
+    }
+    else if (_mode == MINIMIZER_SEEDS) {
+        selectMinimizers(seeds, begin, end, keep);
+    }
+    else {
+        for (long i = begin; i < end; i++) {
+            keep[i] = isSyncmer(seeds[i]);
+        }
+    }
+}
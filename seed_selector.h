@@ -0,0 +1,57 @@
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+#ifndef __SEED_SELECTOR__
+#define __SEED_SELECTOR__
+
+/*
+Which seeds are used to train and query the Bloom filters.
+
+STRIDE_SEEDS trains every seed and queries every stride-th seed of a read.
+Stride 1 uses all seeds.
+
+MINIMIZER_SEEDS keeps a seed if its hash is the smallest of some window of
+`window` consecutive seeds, ties included.
+
+SYNCMER_SEEDS keeps a seed if its smallest `smer_len`-mer, by hash, is the
+first or the last one (closed syncmers).
+
+Both sampling schemes depend only on the sequence. A read then selects the
+same seeds as the reference under it, so training and querying keep only
+the selected seeds.
+*/
+typedef enum SeedSelectMode {
+    STRIDE_SEEDS,
+    MINIMIZER_SEEDS,
+    SYNCMER_SEEDS
+} SeedSelectMode;
+
+class SeedSelector {
+   private:
+    SeedSelectMode _mode;
+    int _seed_len;
+    int _param;
+    uint64_t _smer_mask;
+
+    // Scratch space of select(), so every thread selects with its own copy
+    vector<uint64_t> _hash;
+    vector<uint64_t> _window_min;
+    vector<int> _deque;
+
+    uint64_t hashSeed(uint64_t);
+    bool isSyncmer(uint64_t);
+    void selectMinimizers(const vector<uint64_t>&, long, long,
+                          vector<uint8_t>&);
+
+   public:
+    SeedSelector(SeedSelectMode, int, int);
+    SeedSelectMode getMode();
+    int getParam();
+    bool isSampled();
+    long getContext();
+    void select(const vector<uint64_t>&, long, long, vector<uint8_t>&);
+};
+
+#endif
@@ -1,20 +1,36 @@
 #include "short_read_mapper.h"
 
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <random>
+#include <sstream>
 #include <string>
+#include <thread>
 
+#include "fasta_reader.h"
 #include "utils.h"
 
 #define READ_NOT_MAPPED 0b00
 #define READ_MAPPED 0b01
 #define READ_SATELLITE 0b10
 
+// Strand mask of a query that covers both strands of the read
+#define BOTH_STRANDS ((1 << FORWARD_STRAND) | (1 << REVERSE_STRAND))
+
+// Number of bases unpacked at once when scanning the reference
+#define REF_CHUNK_SIZE 65536
+
+// CML windows merged into one region at most
+#define REGION_WINDOWS 8
+
 using namespace std;
 
 void ShortReadMapper::genSeedMask() {
@@ -25,155 +41,492 @@ void ShortReadMapper::genSeedMask() {
     _seed_mask = seed_mask;
 }
 
-void ShortReadMapper::updateSeed(char& base, uint64_t& seed) {
-    if (base == 'A' || base == 'a')
-        seed = (seed << 2) + 0;
-    else if (base == 'C' || base == 'c')
-        seed = (seed << 2) + 1;
-    else if (base == 'G' || base == 'g')
-        seed = (seed << 2) + 2;
-    else if (base == 'T' || base == 't')
-        seed = (seed << 2) + 3;
-    seed &= _seed_mask;
+void ShortReadMapper::genSeedSelector() {
+    // Strides only apply to querying, the parameter is the query shift
+    int param = _seed_select_mode == STRIDE_SEEDS ? _query_skip_amt
+                                                  : _seed_select_param;
+    delete _seed_selector;
+    _seed_selector = new SeedSelector(_seed_select_mode, _seed_len, param);
 }
 
-void ShortReadMapper::updateRefSeq(char& base, long base_cnt) {
-    if (base == 'A' || base == 'a')
-        _ref_seq[base_cnt] = 'A';
-    else if (base == 'C' || base == 'c')
-        _ref_seq[base_cnt] = 'C';
-    else if (base == 'G' || base == 'g')
-        _ref_seq[base_cnt] = 'G';
-    else if (base == 'T' || base == 't')
-        _ref_seq[base_cnt] = 'T';
+bool ShortReadMapper::isSatellite(ReadWalk& walk, int layer_id, int strand,
+                                  uint8_t hit_cnt[]) {
+    int& layer_hit_cnt = walk.layer_hit_cnt[strand * _layer_num + layer_id];
+    layer_hit_cnt +=
+        countHitBF(hit_cnt, _bf_amount[layer_id], walk.hit_threshold[strand]);
+    return layer_hit_cnt > _satellite_threshold;
 }
 
-string ShortReadMapper::getRefSeqFromLoc(long loc, int len) {
-    // TODO: char* does not have terminating char now
-    char* seq = new char[len];
-    for (int i = 0; i < len; i++) {
-        seq[i] = _ref_seq[loc + i];
+int ShortReadMapper::extractSeeds(MapContext& ctx, ReadWalk& walk) {
+    /*
+    Roll the seeds of both strands of the read once. The reverse
+    complement seed rolls next to the forward one, so the reverse strand
+    seeds come last one first. Keep the selected seeds and scale the hit
+    threshold by the share of the seeds that is kept.
+
+    Return the mask of the strands that have seeds to query.
+    */
+    string& read = walk.read_seq;
+    int rc_shift = 2 * (_seed_len - 1);
+    uint64_t seed = 0;
+    uint64_t rc_seed = 0;
+    ctx.all_seeds[FORWARD_STRAND].clear();
+    ctx.all_seeds[REVERSE_STRAND].clear();
+    for (int i = 0; i < read.length(); i++) {
+        int8_t code = base_code[(uint8_t)read[i]];
+        if (code >= 0) {
+            seed = ((seed << 2) | code) & _seed_mask;
+            rc_seed = (rc_seed >> 2) | ((uint64_t)(3 - code) << rc_shift);
+        }
+
+        // When the seed is not long enough, keep reading base
+        if (i < _seed_len - 1) continue;
+        ctx.all_seeds[FORWARD_STRAND].push_back(seed);
+        ctx.all_seeds[REVERSE_STRAND].push_back(rc_seed);
     }
-    string rv = string(seq);
-    delete seq;
-    return rv;
-}
 
-bool ShortReadMapper::isSatellite(int layer_id, int hit_cnt[]) {
-    for (int i = 0; i < _bf_amount[layer_id]; i++) {
-        if (hit_cnt[i] >= _hit_threshold) {
-            _layer_hit_cnt[layer_id] += 1;
+    int strand_mask = 0;
+    long seed_num = ctx.all_seeds[FORWARD_STRAND].size();
+    for (int s = 0; s < STRAND_NUM; s++) {
+        vector<uint64_t>& all_seeds = ctx.all_seeds[s];
+        ctx.seed_sel->select(all_seeds, 0, seed_num, ctx.keep);
+        walk.seeds[s].clear();
+        for (long i = 0; i < seed_num; i++) {
+            if (ctx.keep[i]) walk.seeds[s].push_back(all_seeds[i]);
         }
+
+        long kept_num = walk.seeds[s].size();
+        if (kept_num == 0) continue;
+        strand_mask |= 1 << s;
+        /*
+        Filters trained on all seeds are dense enough that seeds near a
+        sequencing error often still hit by chance. Filters trained on
+        minimizers or syncmers only are not, and every error costs the
+        read most of the kept seeds around it, so those use their own
+        share of the kept seeds.
+        */
+        long hit_threshold = _hit_threshold * kept_num / seed_num;
+        if (ctx.seed_sel->isSampled())
+            hit_threshold = kept_num * _sampled_hit_share;
+
+        // The hit counters saturate at 255, and a read longer than 255 seeds
+        // must still pass where every seed hits
+        walk.hit_threshold[s] = min((long)UINT8_MAX, max(1L, hit_threshold));
+        ctx.scoreboard.seeds += kept_num;
     }
-    return _layer_hit_cnt[layer_id] > _satellite_threshold;
+    return strand_mask;
 }
 
-void ShortReadMapper::initQuery() {
-    _bml_sel->init();
-    for (int i = 0; i < _layer_num; i++) {
-        _layer_hit_cnt[i] = 0;
+static bool walkNodeLess(const WalkNode& a, const WalkNode& b) {
+    // Heap order: more hits first, then the deeper node, which is closer
+    // to a CML, then the lower bases
+    if (a.hit_cnt != b.hit_cnt) return a.hit_cnt < b.hit_cnt;
+    if (a.layer_id != b.layer_id) return a.layer_id < b.layer_id;
+    return a.base_offset > b.base_offset;
+}
+
+void ShortReadMapper::startWalk(MapContext& ctx, ReadWalk& walk, Read& read) {
+    // Extract the seeds of the read and queue the whole of layer 0
+    walk.read = &read;
+    walk.read_seq.assign(read.seq, read.seq_len);
+    walk.layer_hit_cnt.assign(STRAND_NUM * _layer_num, 0);
+    walk.nodes.clear();
+    walk.cmls.clear();
+    walk.rv = READ_NOT_MAPPED;
+    walk.probes = 0;
+    walk.over_budget = false;
+    walk.depth = -1;
+    walk.start_time = Timer::now();
+
+    int strand_mask = extractSeeds(ctx, walk);
+    if (strand_mask) {
+        WalkNode root = {0, 0, 0, strand_mask, 0};
+        walk.nodes.push_back(root);
+        prefetchNode(ctx, walk);
     }
 }
 
-int ShortReadMapper::queryLayer(string& read, int layer_id, long hier_offset,
-                                long base_offset) {
-    /*
-    In each layer, query every seeds of the read and
-    record the hit count. If hit count > threshold, recursively
-    qurey the next layer.
+void ShortReadMapper::prefetchNode(MapContext& ctx, ReadWalk& walk) {
+    // Request the Bloom filter words the next step of the read loads
+    WalkNode& node = walk.nodes.front();
+    Layer* layer = ctx.layers[node.layer_id];
+    for (int s = 0; s < STRAND_NUM; s++) {
+        if (!(node.strand_mask & (1 << s))) continue;
+        vector<uint64_t>& seeds = walk.seeds[s];
+        for (long i = 0; i < seeds.size(); i++) {
+            layer->prefetch(seeds[i], node.hier_offset);
+        }
+    }
+}
 
-    Return value:
+void ShortReadMapper::stepWalk(MapContext& ctx, ReadWalk& walk) {
+    /*
+    Query the selected seeds of the read in the best node and record the
+    hit count. Bloom filters with hit count > threshold queue their node
+    in the next layer, ranked by that hit count, so the walk goes best
+    first: the filters most seeds hit reach the last layer before the
+    ones that barely pass. Once the read has used _probe_budget seed
+    queries or found _cml_budget CMLs, the nodes left are dropped and the
+    read is aligned with the CMLs found so far.
+
+    Both strands share the walk. Each Bloom filter is descended into
+    once, for the strands in strand_mask whose hits pass.
+
+    walk.rv:
     0th bit: read mapped
     1st bit: satellite
     */
+    pop_heap(walk.nodes.begin(), walk.nodes.end(), walkNodeLess);
+    WalkNode node = walk.nodes.back();
+    walk.nodes.pop_back();
+    int layer_id = node.layer_id;
+    walk.depth = max(walk.depth, layer_id);
+    ctx.metrics.layer_nodes[layer_id]++;
 
     // Whether it is the last layer
     bool last_layer = layer_id == _layer_num - 1;
 
-    // Initialize return value
-    int rv = READ_NOT_MAPPED;
-
-    // Build hit count array
+    // Clear the hit count arrays. The counters saturate at 255, the
+    // thresholds are capped in extractSeeds() to match.
     long bf_amount = _bf_amount[layer_id];
-    int hit_cnt[bf_amount];
-    for (int i = 0; i < bf_amount; i++) {
-        hit_cnt[i] = 0;
+    uint8_t* hit_cnt[STRAND_NUM];
+    int* hit_bf[STRAND_NUM];
+    for (int s = 0; s < STRAND_NUM; s++) {
+        ctx.hit_cnt[s].assign(bf_amount, 0);
+        ctx.hit_bf[s].resize(bf_amount);
+        hit_cnt[s] = ctx.hit_cnt[s].data();
+        hit_bf[s] = ctx.hit_bf[s].data();
     }
 
-    // Generate seed and query the layer
-    uint64_t seed = 0;
-    for (int i = 0; i < read.length(); i++) {
-        updateSeed(read[i], seed);
-        seed &= _seed_mask;
-
-        // When the seed is not long enough, keep reading base
-        if (i < _seed_len - 1) continue;
+    // Query the layer, both strands together as long as both have seeds
+    // If it's the last layer, OR the nearby Bloom filter
+    Layer* layer = ctx.layers[layer_id];
+    vector<uint64_t>& fwd_seeds = walk.seeds[FORWARD_STRAND];
+    vector<uint64_t>& rev_seeds = walk.seeds[REVERSE_STRAND];
+    long pair_num = 0;
+    if (node.strand_mask == BOTH_STRANDS)
+        pair_num = min(fwd_seeds.size(), rev_seeds.size());
+    for (long i = 0; i < pair_num; i++) {
+        layer->queryPair(fwd_seeds[i], hit_cnt[FORWARD_STRAND], rev_seeds[i],
+                         hit_cnt[REVERSE_STRAND], node.hier_offset, last_layer);
+    }
+    for (int s = 0; s < STRAND_NUM; s++) {
+        if (!(node.strand_mask & (1 << s))) continue;
+        vector<uint64_t>& seeds = walk.seeds[s];
+        for (long i = pair_num; i < seeds.size(); i++) {
+            layer->query(seeds[i], hit_cnt[s], node.hier_offset, last_layer);
+        }
+        walk.probes += seeds.size();
+        ctx.scoreboard.seed_queries += seeds.size();
+        ctx.metrics.layer_probes[layer_id] += seeds.size();
+    }
 
-        // Query the layer
-        // If it's the last layer, OR the nearby Bloom filter
-        if (last_layer)
-            _layers[layer_id]->query(seed, hit_cnt, hier_offset, true);
+    // Bloom filters with enough hits, per strand. Layer 0 sets its
+    // threshold from the hit counts of the filters holding bases.
+    long root_num = min(bf_amount, (_ref_len + _seed_range[0] - 1) /
+                                       _seed_range[0]);
+    int hit_bf_num[STRAND_NUM] = {0};
+    for (int s = 0; s < STRAND_NUM; s++) {
+        if (!(node.strand_mask & (1 << s))) continue;
+
+        // A zero threshold would pass Bloom filters without any hit
+        long hit_threshold;
+        if (layer_id == 0)
+            hit_threshold = max(1L, min(meanPlusStdev(hit_cnt[s], root_num, 1),
+                                        walk.hit_threshold[s]));
         else
-            _layers[layer_id]->query(seed, hit_cnt, hier_offset, false);
-    }
-
-    long hit_threshold;
-    if (layer_id == 0)
-        hit_threshold = min(meanPlusStdev(hit_cnt, 14, 1), _hit_threshold);
-    else
-        hit_threshold = _hit_threshold;
-
-    if (layer_id == 1) {
-        int max_hit_cnt = findMax(hit_cnt, bf_amount);
-        if (countHitBF(hit_cnt, bf_amount, hit_threshold) == 0) {
-            hit_threshold = max_hit_cnt;
-        }
-    }
-
-    // printHitCnt(layer_id, hit_cnt, bf_amount);
-
-    // If too many hits, return satelllite code
-    if (layer_id != 0)
-        if (isSatellite(layer_id, hit_cnt)) return READ_SATELLITE;
-
-    // For each Bloom filter
-    for (int i = 0; i < bf_amount; i++) {
-        if (hit_cnt[i] >= hit_threshold) {
-            // If it is the last layer,
-            // use the BML selector to calculate the score.
-            if (last_layer) {
-                rv = READ_MAPPED;
-                // Calculate the CML location
-                long cml_loc = base_offset + i * _seed_range[layer_id];
-                int seq_len = _seed_range[layer_id] * 2;
-                string ref_seq = getRefSeqFromLoc(cml_loc, seq_len);
-
-                // Send one CML to the BML engine
-                _seeding_sw->pause();
-                _seed_extraction_sw->start();
-                _bml_sel->update(ref_seq, read, cml_loc);
-                _seeding_sw->start();
-                _seed_extraction_sw->pause();
+            hit_threshold = walk.hit_threshold[s];
+
+        if (layer_id == 1) {
+            int max_hit_cnt = findMax(hit_cnt[s], bf_amount);
+            if (countHitBF(hit_cnt[s], bf_amount, hit_threshold) == 0) {
+                hit_threshold = max(1, max_hit_cnt);
+            }
+        }
+
+        // printHitCnt(layer_id, hit_cnt[s], bf_amount);
+
+        // If too many hits, the read is satelllite, drop the rest of it
+        if (layer_id != 0 && isSatellite(walk, layer_id, s, hit_cnt[s])) {
+            walk.rv |= READ_SATELLITE;
+            walk.nodes.clear();
+            ctx.metrics.layer_satellite[layer_id]++;
+            return;
+        }
+
+        hit_bf_num[s] = collectHitBF(hit_cnt[s], bf_amount, hit_threshold,
+                                     hit_bf[s]);
+    }
+
+    // For each Bloom filter with enough hits on either strand
+    int next[STRAND_NUM] = {0};
+    while (true) {
+        int i = bf_amount;
+        for (int s = 0; s < STRAND_NUM; s++) {
+            if (next[s] < hit_bf_num[s]) i = min(i, hit_bf[s][next[s]]);
+        }
+        if (i == bf_amount) break;
+
+        int child_mask = 0;
+        int child_hit_cnt = 0;
+        for (int s = 0; s < STRAND_NUM; s++) {
+            if (next[s] < hit_bf_num[s] && hit_bf[s][next[s]] == i) {
+                child_mask |= 1 << s;
+                child_hit_cnt = max(child_hit_cnt, (int)hit_cnt[s][i]);
+                next[s]++;
+            }
+        }
+
+        // Filters past the reference hold no bases, and fitLayers() left
+        // out the groups below them
+        if (node.base_offset + i * _seed_range[layer_id] >= _ref_len) continue;
+
+        // If it is the last layer, collect the CML, the BML selector
+        // aligns all CMLs of the read together once the walk is done.
+        if (last_layer) {
+            walk.rv |= READ_MAPPED;
+            long cml_loc = node.base_offset + i * _seed_range[layer_id];
+            for (int s = 0; s < STRAND_NUM; s++) {
+                if (child_mask & (1 << s))
+                    walk.cmls.push_back(make_pair(cml_loc, s));
+            }
+        }
+        // If not the last layer, queue the node in the next layer
+        else {
+            // The children sit in the group of the next layer numbered by
+            // the bases they cover, whatever the sizes of both layers
+            int next_id = layer_id + 1;
+            long child_base = node.base_offset + i * _seed_range[layer_id];
+            long group =
+                child_base / (_seed_range[next_id] * _bf_amount[next_id]);
+            WalkNode child = {next_id,
+                              group * _bf_amount[next_id] * _bf_size[next_id],
+                              child_base, child_mask, child_hit_cnt};
+            walk.nodes.push_back(child);
+            push_heap(walk.nodes.begin(), walk.nodes.end(), walkNodeLess);
+        }
+    }
+
+    bool probes_out = _probe_budget > 0 && walk.probes >= _probe_budget;
+    bool cmls_out = _cml_budget > 0 && (long)walk.cmls.size() >= _cml_budget;
+    if (!walk.nodes.empty() && (probes_out || cmls_out)) {
+        walk.over_budget = true;
+        walk.nodes.clear();
+    }
+    if (!walk.nodes.empty()) prefetchNode(ctx, walk);
+}
+
+void ShortReadMapper::finishWalk(MapContext& ctx, ReadWalk& walk) {
+    // Align the CMLs of the read and select the best one
+    double start_time = Timer::now();
+    BMLSelector* bml_sel = ctx.bml_sel;
+    bml_sel->init();
+    if (!(walk.rv & READ_SATELLITE)) {
+        bml_sel->setRead(walk.read_seq);
+        ctx.scoreboard.cmls += walk.cmls.size();
+
+        /*
+        Neighbouring CMLs of the last layer have overlapping windows, as
+        each one covers the Bloom filter next to it too. Windows of a
+        strand that overlap or touch are merged into one region of up to
+        REGION_WINDOWS windows, so each reference base is unpacked and
+        aligned once per strand rather than once per CML. The walk finds
+        CMLs in any order, sorting them keeps ties going the same way.
+        */
+        sort(walk.cmls.begin(), walk.cmls.end());
+        int seq_len = _seed_range[_layer_num - 1] * 2;
+        long max_region_len = REGION_WINDOWS * seq_len;
+        long read_len = walk.read_seq.size();
+        for (int s = 0; s < STRAND_NUM; s++) {
+            ctx.regions[s].clear();
+        }
+        for (int c = 0; c < walk.cmls.size(); c++) {
+            long cml_loc = walk.cmls[c].first;
+            int strand = walk.cmls[c].second;
+            vector<pair<long, long> >& regions = ctx.regions[strand];
+            if (regions.empty() || cml_loc > regions.back().second) {
+                regions.push_back(make_pair(cml_loc, cml_loc + seq_len));
+            }
+            else if (cml_loc + seq_len - regions.back().first <=
+                     max_region_len) {
+                regions.back().second = cml_loc + seq_len;
             }
-            // If not the last layer, query the next layer
             else {
-                long hier_offset_next = hier_offset + i * _bf_size[layer_id];
-                long base_offset_next = base_offset + i * _seed_range[layer_id];
-
-                rv |= queryLayer(read, layer_id + 1, hier_offset_next,
-                                 base_offset_next);
-                // If we found the read is satellite at the child layer,
-                // return immediately.
-                if (rv & READ_SATELLITE) return rv;
+                // A full region overlaps the next one by a read length
+                // only, which an alignment across the split needs
+                long begin = max(cml_loc, regions.back().second - read_len);
+                regions.push_back(make_pair(begin, cml_loc + seq_len));
             }
         }
+
+        // Regions in reference order, the forward strand first
+        int next[STRAND_NUM] = {0};
+        while (true) {
+            int s = -1;
+            for (int t = 0; t < STRAND_NUM; t++) {
+                if (next[t] == ctx.regions[t].size()) continue;
+                if (s < 0 || ctx.regions[t][next[t]].first <
+                                 ctx.regions[s][next[s]].first)
+                    s = t;
+            }
+            if (s < 0) break;
+            pair<long, long>& region = ctx.regions[s][next[s]++];
+            ctx.ref_seq->extract(region.first, region.second - region.first,
+                                 bml_sel->addCandidate(region.first, s));
+            ctx.scoreboard.regions++;
+        }
+        bml_sel->alignCandidates();
     }
 
-    return rv;
+    // Get mapped location from the BML selector
+    long mapped_loc = bml_sel->getMapLoc();
+    bool verbose = false;
+    updateScoreboard(ctx.scoreboard, walk.rv, *walk.read, mapped_loc,
+                     verbose);
+
+    // Only the winning CML gets a CIGAR
+    if (_output != NULL) {
+        // The reference is the contigs back to back, an alignment over
+        // a join has no position in either, so the read is unmapped
+        bool aligned = (walk.rv & READ_MAPPED) &&
+                       !(walk.rv & READ_SATELLITE) &&
+                       bml_sel->traceAlignment(ctx.aln) &&
+                       _ref_seq->findContig(ctx.aln.ref_begin) ==
+                           _ref_seq->findContig(ctx.aln.ref_end - 1);
+        if (_output_format == SAM_FORMAT)
+            appendSam(ctx, walk, aligned);
+        else if (aligned)
+            appendPaf(ctx, walk);
+    }
+
+    // Where the walk of an unmapped read stopped
+    MapMetrics& metrics = ctx.metrics;
+    if (walk.over_budget) metrics.over_budget++;
+    if (walk.rv == READ_NOT_MAPPED) {
+        if (walk.depth < 0)
+            metrics.no_seed++;
+        else
+            metrics.layer_unmapped[walk.depth]++;
+    }
+    metrics.reads++;
+    double end_time = Timer::now();
+    metrics.seed_extraction.add(end_time - start_time);
+    metrics.latency.add(end_time - walk.start_time);
 }
 
-void ShortReadMapper::updateScoreboard(int& rv, long& golden_loc,
-                                       long& mapped_loc, bool verbose) {
+void ShortReadMapper::appendSam(MapContext& ctx, ReadWalk& walk,
+                                bool aligned) {
+    // One SAM line, reverse strand reads are stored reverse complemented
+    string& out = ctx.output;
+    Alignment& aln = ctx.aln;
+    out.append(walk.read->name, walk.read->name_len);
+    if (!aligned) {
+        out += "\t4\t*\t0\t0\t*\t*\t0\t0\t";
+        out += walk.read_seq;
+        out += "\t*";
+        if (walk.over_budget) out += "\tZB:i:1";
+        out += '\n';
+        return;
+    }
+
+    int contig = _ref_seq->findContig(aln.ref_begin);
+    const Contig& ctg = _ref_seq->getContigs()[contig];
+    int read_len = walk.read_seq.size();
+    out += aln.strand == REVERSE_STRAND ? "\t16\t" : "\t0\t";
+    out += ctg.name;
+    out += '\t';
+    out += to_string(aln.ref_begin - ctg.begin + 1);
+    out += "\t255\t";
+    if (aln.read_begin > 0) out += to_string(aln.read_begin) + 'S';
+    out += aln.cigar;
+    if (aln.read_end < read_len)
+        out += to_string(read_len - aln.read_end) + 'S';
+    out += "\t*\t0\t0\t";
+    if (aln.strand == REVERSE_STRAND) {
+        for (int i = read_len - 1; i >= 0; i--) {
+            out += complementBase(walk.read_seq[i]);
+        }
+    }
+    else {
+        out += walk.read_seq;
+    }
+    out += "\t*\tAS:i:";
+    out += to_string(aln.score);
+    if (walk.over_budget) out += "\tZB:i:1";
+    out += '\n';
+}
+
+void ShortReadMapper::appendPaf(MapContext& ctx, ReadWalk& walk) {
+    // One PAF line, query coordinates are on the read as sequenced
+    string& out = ctx.output;
+    Alignment& aln = ctx.aln;
+    int read_len = walk.read_seq.size();
+    int query_begin = aln.read_begin;
+    int query_end = aln.read_end;
+    if (aln.strand == REVERSE_STRAND) {
+        query_begin = read_len - aln.read_end;
+        query_end = read_len - aln.read_begin;
+    }
+    int contig = _ref_seq->findContig(aln.ref_begin);
+    const Contig& ctg = _ref_seq->getContigs()[contig];
+
+    // Alignment columns, every CIGAR operation is one
+    long block_len = 0;
+    for (int p = 0, len = 0; p < aln.cigar.size(); p++) {
+        char c = aln.cigar[p];
+        if (c >= '0' && c <= '9') {
+            len = len * 10 + c - '0';
+        }
+        else {
+            block_len += len;
+            len = 0;
+        }
+    }
+
+    out.append(walk.read->name, walk.read->name_len);
+    out += '\t' + to_string(read_len);
+    out += '\t' + to_string(query_begin);
+    out += '\t' + to_string(query_end);
+    out += aln.strand == REVERSE_STRAND ? "\t-\t" : "\t+\t";
+    out += ctg.name;
+    out += '\t' + to_string(_ref_seq->getContigLen(contig));
+    out += '\t' + to_string(aln.ref_begin - ctg.begin);
+    out += '\t' + to_string(aln.ref_end - ctg.begin);
+    out += '\t' + to_string(aln.match_num);
+    out += '\t' + to_string(block_len);
+    out += "\t255\ttp:A:P\tcg:Z:";
+    out += aln.cigar;
+    out += "\tAS:i:" + to_string(aln.score);
+    if (walk.over_budget) out += "\tZB:i:1";
+    out += '\n';
+}
+
+void ShortReadMapper::writeSamHeader() {
+    // One @SQ line per record of the reference
+    string header = "@HD\tVN:1.6\tSO:unsorted\n";
+    const vector<Contig>& contigs = _ref_seq->getContigs();
+    for (int c = 0; c < contigs.size(); c++) {
+        header += "@SQ\tSN:" + contigs[c].name;
+        header += "\tLN:" + to_string(_ref_seq->getContigLen(c)) + '\n';
+    }
+    header += "@PG\tID:short_read_mapper\tPN:short_read_mapper\n";
+    _output->write(header);
+}
+
+bool ShortReadMapper::isGoldenLoc(Read& read, long mapped_loc) {
+    // Same contig as the golden location, and an offset within the margin
+    int contig = _ref_seq->findContig(mapped_loc);
+    if (contig < 0) return false;
+    const Contig& mapped = _ref_seq->getContigs()[contig];
+    if (mapped.name.size() != read.golden_contig_len ||
+        memcmp(mapped.name.data(), read.golden_contig, mapped.name.size()) != 0)
+        return false;
+    return abs(read.golden_loc - (mapped_loc - mapped.begin)) <= _ans_margin;
+}
+
+void ShortReadMapper::updateScoreboard(Scoreboard& scoreboard, int& rv,
+                                       Read& read, long& mapped_loc,
+                                       bool verbose) {
     /*
     Return value:
     0th bit: read mapped
@@ -182,23 +535,27 @@ void ShortReadMapper::updateScoreboard(int& rv, long& golden_loc,
 
     if (rv & READ_SATELLITE) {
         // Satellite
-        _satellite += 1;
+        scoreboard.satellite += 1;
         if (verbose) cout << "Satellite" << endl;
     }
     else if (rv & READ_MAPPED) {
         // Mapped
-        if (abs(golden_loc - mapped_loc) <= _ans_margin) {
-            _correctly_mapped += 1;
+        if (read.golden_loc == NO_GOLDEN_LOC) {
+            scoreboard.unverified += 1;
+            if (verbose) cout << "Mapped, no golden location" << endl;
+        }
+        else if (isGoldenLoc(read, mapped_loc)) {
+            scoreboard.correctly_mapped += 1;
             if (verbose) cout << "Correctly mapped" << endl;
         }
         else {
-            _wrongly_mapped += 1;
+            scoreboard.wrongly_mapped += 1;
             if (verbose) cout << "Wrongly mapped" << endl;
         }
     }
     else {
         // Not mapped
-        _not_mapped += 1;
+        scoreboard.not_mapped += 1;
         if (verbose) cout << "Not mapped" << endl;
     }
 }
@@ -221,7 +578,7 @@ ShortReadMapper::ShortReadMapper(string& ref_path, string& read_path,
     _satellite_threshold = satellite_threshold;
     _layer_num = 3;
 
-    // Bloom filters configuration
+    // Bloom filters configuration, unless loadLayerConfig() replaces it
     // 16 MB for each Bloom filter in layer 1
     // 64 kB for each Bloom filter in layer 2
     // 256 Bytes for each Bloom filter in layer 3
@@ -251,10 +608,77 @@ ShortReadMapper::ShortReadMapper(string& ref_path, string& read_path,
     _seed_range[1] = 256 * 256;
     _seed_range[2] = 256;
 
-    // Mapping configuration
-    _test_num = 10000;
-    _ref_size = 2948627755;
+    // One hash per Bloom filter, more use blocked Bloom filters
+    _hash_num = new int[_layer_num];
+    _hash_num[0] = 1;
+    _hash_num[1] = 1;
+    _hash_num[2] = 1;
+
+    _root_amount = _bf_amount[0];
+
+    // Mapping configuration, sized from the reference when training
+    _ref_size = 0;
+    _ref_len = 0;
+
+    // Instantiate N layers
+    _layers = NULL;
+    genLayers();
+
+    // Transparent huge pages, placed by the first touch, unless told
+    // otherwise
+    _mem_config.huge_pages = TRANSPARENT_HUGE_PAGES;
+    _mem_config.numa = NUMA_LOCAL;
+    _mem_config.touch_threads = 0;
+
+    // The reference is allocated when it is loaded
+    _ref_seq = new PackedRefSeq(0, _mem_config);
+    _index = NULL;
+
+    // No per-read output unless told otherwise
+    _output_format = SAM_FORMAT;
+    _output = NULL;
+
+    // Map with a single thread unless told otherwise
+    _thread_num = 1;
+    _walk_num = 8;
+    _band_width = 16;
+
+    // Walks are not cut short unless told otherwise
+    _probe_budget = 0;
+    _cml_budget = 0;
+
+    // Query every seed of the read unless told otherwise
+    _seed_select_mode = STRIDE_SEEDS;
+    _seed_select_param = 1;
+    _seed_selector = NULL;
+    genSeedSelector();
+    _sampled_hit_share = 0.4;
+
+    // Seeds are only counted when training ignores satellite DNA
+    _ignore_satellite = false;
+    _seed_count_mode = EXACT_COUNT;
+    _seed_counter = NULL;
+
+    // Scoreboard
+    _scoreboard.reset();
+    _map_wall_sec = 0;
+    _mapped_read_cnt = 0;
+
+    _training_timer.reset();
+    _metrics.reset(_layer_num);
+}
+
+ShortReadMapper::~ShortReadMapper() {
+    // Layer configuration
+    freeLayers();
 
+    delete _ref_seq;
+    delete _index;
+    delete _seed_counter;
+    delete _seed_selector;
+}
+
+void ShortReadMapper::genLayers() {
     // Generate hash factor
     int rand_seed = 666;
     srand(1);
@@ -266,256 +690,959 @@ ShortReadMapper::ShortReadMapper(string& ref_path, string& read_path,
         hash_factors[i] = distribution(generator);
     }
 
-    // Instantiate N layers
     _layers = new Layer*[_layer_num];
     for (int i = 0; i < _layer_num; i++) {
         _layers[i] = new Layer(_bf_size[i], _bf_amount[i], _bf_total[i],
-                               _seed_range[i], hash_factors[i]);
+                               _seed_range[i], hash_factors[i], _hash_num[i]);
     }
+}
 
-    // Total hit count in each layer
-    // If hit_cnt > _satellite_threshold, read is satellite
-    _layer_hit_cnt = new int[_layer_num];
-
-    // Initialize _ref_seq
-    _ref_seq = new char[_ref_size];
+void ShortReadMapper::allocLayers() {
+    // Memory of the layers to train, and what the kernel gave for it
+    for (int i = 0; i < _layer_num; i++) {
+        _layers[i]->allocate(_mem_config, -1);
+        cout << "[allocLayers] Layer " << i << ": "
+             << describeMemory(_layers[i]->getBlock()) << endl;
+    }
+}
 
-    // Instantiate BML selector
-    _bml_sel = new BMLSelector();
+long ShortReadMapper::fitRootAmount(long ref_len) {
+    /*
+    Layer-0 Bloom filters holding bases of a reference of ref_len bases,
+    rounded up to a power of two so that the shifts of getMemLoc() still
+    apply, and to the 32 filters blocked Bloom filters need.
+    */
+    long root_num = (ref_len + _seed_range[0] - 1) / _seed_range[0];
+    long amount = 1;
+    while (amount < root_num) amount *= 2;
+    if (_hash_num[0] > 1) amount = max(amount, 32L);
+    return min(amount, _root_amount);
+}
 
-    // Scoreboard
-    _correctly_mapped = 0;
-    _wrongly_mapped = 0;
-    _satellite = 0;
-    _not_mapped = 0;
+void ShortReadMapper::fitLayers(long ref_len) {
+    /*
+    Shrink the configured hierarchy to the reference: layer 0 keeps the
+    Bloom filters of fitRootAmount(), deeper layers only the groups below
+    the filters holding bases. Memory then grows with the reference, not
+    with the configuration.
+    */
+    if (ref_len > _root_amount * _seed_range[0]) {
+        cerr << "[fitLayers] The layers cover " << _root_amount * _seed_range[0]
+             << " bases, the reference has " << ref_len << endl;
+        exit(1);
+    }
+    _bf_amount[0] = fitRootAmount(ref_len);
+    _bf_total[0] = _bf_amount[0];
+    for (int i = 1; i < _layer_num; i++) {
+        long group_range = _seed_range[i] * _bf_amount[i];
+        long group_num = max(1L, (ref_len + group_range - 1) / group_range);
+        _bf_total[i] = group_num * _bf_amount[i];
+    }
 
-    // Stopwatch
-    _training_sw = new Stopwatch();
-    _seeding_sw = new Stopwatch();
-    _seed_extraction_sw = new Stopwatch();
-    _training_sw->reset();
-    _seeding_sw->reset();
-    _seed_extraction_sw->reset();
+    for (int i = 0; i < _layer_num; i++) {
+        delete _layers[i];
+    }
+    delete[] _layers;
+    genLayers();
 }
 
-ShortReadMapper::~ShortReadMapper() {
-    // Layer configuration
+void ShortReadMapper::freeLayers() {
+    for (int i = 0; i < _layer_num; i++) {
+        delete _layers[i];
+    }
+    delete[] _layers;
     delete[] _bf_size;
     delete[] _bf_amount;
     delete[] _bf_total;
     delete[] _seed_range;
+    delete[] _hash_num;
+    _layers = NULL;
+}
+
+void ShortReadMapper::loadLayerConfig(string path) {
+    /*
+    Replace the layer hierarchy with the one in the config file:
+
+    cml_range <bases covered by a Bloom filter of the last layer>
+    layer <Bloom filter size in bytes> <Bloom filters below each parent>
+          [hashes]
+    ...
+
+    One layer line per layer, the first one is layer 0. '#' starts a
+    comment. Layers with more than one hash use blocked Bloom filters,
+    see layer.h.
+    */
+    ifstream config(path);
+    if (!config.is_open()) {
+        cerr << "[loadLayerConfig] Cannot open " << path << endl;
+        exit(1);
+    }
+
+    long cml_range = 0;
+    vector<long> sizes;
+    vector<long> amounts;
+    vector<int> hash_nums;
+    string line;
+    int line_num = 0;
+    while (getline(config, line)) {
+        line_num++;
+        line = line.substr(0, line.find('#'));
+        istringstream fields(line);
+        string key;
+        if (!(fields >> key)) continue;
+
+        bool valid;
+        if (key == "cml_range") {
+            valid = bool(fields >> cml_range) && cml_range > 0;
+        }
+        else if (key == "layer") {
+            long size, amount;
+            int hash_num = 1;
+            valid = bool(fields >> size >> amount);
+            if (valid && !(fields >> hash_num)) hash_num = 1;
+            sizes.push_back(size);
+            amounts.push_back(amount);
+            hash_nums.push_back(hash_num);
+
+            // Bloom filters are indexed with a mask and loaded in words
+            valid = valid && size >= 4 && (size & (size - 1)) == 0 &&
+                    amount > 0 && hash_num >= 1 && hash_num <= BLOCK_MAX_HASH;
+        }
+        else {
+            valid = false;
+        }
+        if (!valid) {
+            cerr << "[loadLayerConfig] Invalid line " << line_num << " in "
+                 << path << endl;
+            exit(1);
+        }
+    }
+    if (cml_range == 0 || sizes.empty() || sizes.size() > INDEX_MAX_LAYER) {
+        cerr << "[loadLayerConfig] " << path << " needs cml_range and 1 to "
+             << INDEX_MAX_LAYER << " layers" << endl;
+        exit(1);
+    }
+
+    freeLayers();
+    _layer_num = sizes.size();
+    _bf_size = new long[_layer_num];
+    _bf_amount = new long[_layer_num];
+    _bf_total = new long[_layer_num];
+    _seed_range = new long[_layer_num];
+    _hash_num = new int[_layer_num];
+    _root_amount = amounts[0];
     for (int i = 0; i < _layer_num; i++) {
-        delete _layers[i];
+        _bf_size[i] = sizes[i] * 8;
+        _bf_amount[i] = amounts[i];
+        _hash_num[i] = hash_nums[i];
+        _bf_total[i] = (i == 0 ? 1 : _bf_total[i - 1]) * amounts[i];
     }
-    delete[] _layers;
-    delete[] _layer_hit_cnt;
 
-    delete _ref_seq;
-    delete _bml_sel;
+    // A Bloom filter covers the bases of all its children
+    _seed_range[_layer_num - 1] = cml_range;
+    for (int i = _layer_num - 2; i >= 0; i--) {
+        _seed_range[i] = _seed_range[i + 1] * _bf_amount[i + 1];
+    }
+    genLayers();
 
-    // Stopwatch
-    delete _training_sw;
-    delete _seeding_sw;
-    delete _seed_extraction_sw;
+    cout << "[loadLayerConfig] " << _layer_num << " layers from " << path
+         << endl;
 }
 
-void ShortReadMapper::trainBF(bool ignoreSatellite) {
-    cout << "[trainBF] Start training the Bloom filter" << endl;
-    if (ignoreSatellite) cout << "[trainBF] Ignore satellite DNA" << endl;
+void ShortReadMapper::setThreadNum(int thread_num) {
+    _thread_num = max(thread_num, 1);
+}
 
-    // Start stopwatch
-    _training_sw->start();
+void ShortReadMapper::setWalkNum(int walk_num) {
+    _walk_num = max(walk_num, 1);
+}
 
-    // Seed
-    uint64_t seed = 0;
-    long base_cnt = 0;
+void ShortReadMapper::setWalkBudget(long probe_budget, long cml_budget) {
+    _probe_budget = max(probe_budget, 0L);
+    _cml_budget = max(cml_budget, 0L);
+}
+
+void ShortReadMapper::setBandWidth(int band_width) {
+    _band_width = max(band_width, 0);
+}
+
+void ShortReadMapper::setMemConfig(MemConfig config) {
+    _mem_config = config;
+}
 
-    // Open ref file
-    ifstream ref_seq_fs(_ref_path);
-    if (!ref_seq_fs.is_open()) {
+void ShortReadMapper::setOutput(string path, OutputFormat format) {
+    _output_path = path;
+    _output_format = format;
+}
+
+void ShortReadMapper::setSeedCountMode(SeedCountMode mode) {
+    _seed_count_mode = mode;
+}
+
+void ShortReadMapper::setSeedSelectMode(SeedSelectMode mode, int param) {
+    _seed_select_mode = mode;
+    _seed_select_param = param;
+    genSeedSelector();
+}
+
+void ShortReadMapper::setSampledHitShare(double share) {
+    _sampled_hit_share = share;
+}
+
+void ShortReadMapper::scanRef() {
+    // Count the bases first, so that the layers and the reference buffer
+    // are sized for this reference
+    FastaReader reader(_ref_path);
+    if (!reader.open()) {
         cerr << "[trainBF] Cannot open the reference sequence file." << endl;
         exit(1);
     }
+    double start = Timer::now();
+    _ref_size = reader.countBases();
+    fitLayers(_ref_size);
+    double sec = Timer::now() - start;
 
-    string line;
+    long bytes = 0;
+    for (int i = 0; i < _layer_num; i++) {
+        bytes += _layers[i]->getMemSize() * sizeof(int);
+    }
+    cout << "[trainBF] Counted " << _ref_size << " bases in " << fixed
+         << setprecision(3) << sec << " s, " << _bf_amount[0] << " of "
+         << _root_amount << " layer-0 Bloom filters, " << (bytes >> 20)
+         << " MB of layers" << endl;
+    cout.unsetf(ios::floatfield);
+}
 
-    // If ignoreSatellite, start building the _seed_cnt map
-    if (ignoreSatellite) {
-        // First pass seed and base_cnt
-        uint64_t seed_fp = 0;
-        long base_cnt_fp = 0;
+void ShortReadMapper::loadRef() {
+    // Map the ref file and pack its bases
+    FastaReader reader(_ref_path);
+    if (!reader.open()) {
+        cerr << "[trainBF] Cannot open the reference sequence file." << endl;
+        exit(1);
+    }
 
-        while (ref_seq_fs >> line) {
-            // If the line starts with '>', ignore it
-            if (line[0] == '>') continue;
+    // Bases are appended in order, so the pages are not touched up front
+    MemConfig ref_config = _mem_config;
+    ref_config.touch_threads = 0;
+    delete _ref_seq;
+    _ref_seq = new PackedRefSeq(_ref_size, ref_config);
+    cout << "[trainBF] Reference: " << describeMemory(_ref_seq->getBlock())
+         << endl;
 
-            // For each character, generate a seed
-            for (int i = 0; i < line.size(); i++) {
-                updateSeed(line[i], seed_fp);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    _ref_len = reader.read(_ref_seq, _ref_size);
+    double sec = chrono::duration<double>(chrono::steady_clock::now() - start)
+                     .count();
+
+    streamsize precision = cout.precision();
+    cout << "[trainBF] Loaded " << _ref_len << " bases ("
+         << _ref_seq->getAmbiguousLen() << " ambiguous) in " << fixed
+         << setprecision(2) << sec << " s, " << _ref_len / max(sec, 1e-9) / 1e6
+         << " Mbases/s" << endl;
+    cout.unsetf(ios::floatfield);
+    cout.precision(precision);
+    cout << "[trainBF] " << _ref_seq->getContigs().size() << " contigs, "
+         << _ref_seq->getBreaks().size() << " breaks, " << countSkippedSeeds()
+         << " seeds not indexed" << endl;
+}
 
-                // If the seed variable contains more than seed_len seeds,
-                // start updating seed count.
-                if (base_cnt_fp >= _seed_len - 1) {
-                    findAndIncrement(_seed_cnt, seed_fp);
-                }
+long ShortReadMapper::countSkippedSeeds() {
+    /*
+    Seeds ending at the first _seed_len - 1 bases, or less than _seed_len
+    bases past the start of a break, are not indexed
+    */
+    const vector<RefBreak>& breaks = _ref_seq->getBreaks();
+    long covered = min(_seed_len - 1, _ref_len);
+    long skipped = covered;
+    for (int b = 0; b < breaks.size(); b++) {
+        long lo = max(breaks[b].begin, covered);
+        long hi = min(breaks[b].end + _seed_len - 1, _ref_len);
+        if (hi <= lo) continue;
+        skipped += hi - lo;
+        covered = hi;
+    }
+    return skipped;
+}
+
+void ShortReadMapper::collectSeeds(long first, long last,
+                                   vector<uint64_t>& seeds,
+                                   vector<uint8_t>& valid) {
+    /*
+    Seeds ending at bases [first, last). A seed is valid when its bases
+    are all ACGT and in one contig, i.e. it starts at or after the end of
+    every break beginning at or before its last base.
+    */
+    long start = max(first - _seed_len + 1, 0L);
+    vector<int8_t> codes;
+    _ref_seq->extractCodes(start, last - start, codes);
+    const vector<RefBreak>& breaks = _ref_seq->getBreaks();
+    int b = _ref_seq->findBreak(start);
+    long clean = 0;
+
+    uint64_t seed = 0;
+    seeds.resize(last - first);
+    valid.resize(last - first);
+    for (long pos = start; pos < last; pos++) {
+        while (b < breaks.size() && breaks[b].begin <= pos) {
+            clean = breaks[b].end;
+            b++;
+        }
+        seed = ((seed << 2) | (codes[pos - start] & 3)) & _seed_mask;
+        if (pos < first) continue;
+        seeds[pos - first] = seed;
+        valid[pos - first] = pos - _seed_len + 1 >= clean;
+    }
+}
 
-                base_cnt_fp += 1;
-                if (base_cnt_fp % 10000000 == 0)
-                    cout << "[trainBF] Counted for " << base_cnt_fp << " seeds"
-                         << endl;
-                if (base_cnt_fp == _ref_size) break;
+void ShortReadMapper::trainRange(long begin, long end, bool ignoreSatellite,
+                                 bool concurrent) {
+    /*
+    Add the seeds ending in [begin, end) to the Bloom filters, chunk by
+    chunk. When the seeds are sampled, each chunk also rolls the
+    neighbouring seeds that decide which of its own seeds are kept.
+    */
+    SeedSelector selector = *_seed_selector;
+    bool sampled = selector.isSampled();
+    long context = selector.getContext();
+    vector<uint64_t> seeds;
+    vector<uint8_t> valid;
+    vector<uint8_t> keep;
+    for (long chunk_begin = begin; chunk_begin < end;
+         chunk_begin += REF_CHUNK_SIZE) {
+        long chunk_end = min(chunk_begin + REF_CHUNK_SIZE, end);
+        long first = max(chunk_begin - context, 0L);
+        long last = min(chunk_end + context, _ref_len);
+        collectSeeds(first, last, seeds, valid);
+        if (sampled)
+            selector.select(seeds, chunk_begin - first, chunk_end - first,
+                            keep);
+
+        for (long i = chunk_begin - first; i < chunk_end - first; i++) {
+            long base_cnt = first + i;
+            uint64_t& seed = seeds[i];
+
+            // Seeds across an N run or a contig join are not in the
+            // reference, so they would only add false hits
+            if (!valid[i]) continue;
+            if (sampled && !keep[i]) continue;
+            if (ignoreSatellite && _seed_counter->isFrequent(seed)) continue;
+
+            // Layer-0 filters of different ranges share memory words, the
+            // lower layers do not.
+            if (concurrent)
+                _layers[0]->updateAtomic(seed, base_cnt);
+            else
+                _layers[0]->update(seed, base_cnt);
+            for (int l = 1; l < _layer_num; l++) {
+                _layers[l]->update(seed, base_cnt);
             }
         }
+    }
+}
+
+void ShortReadMapper::trainWorker(atomic<long>& next_range,
+                                  bool ignoreSatellite) {
+    long range_num = (_ref_len + _seed_range[0] - 1) / _seed_range[0];
+    while (true) {
+        long range = next_range.fetch_add(1);
+        if (range >= range_num) break;
+
+        long begin = range * _seed_range[0];
+        long end = min(begin + _seed_range[0], _ref_len);
+        trainRange(begin, end, ignoreSatellite, true);
+
+        cout << "[trainBF] Trained range " << range << endl;
+    }
+}
 
-        // Set file stream position to the beginning
-        ref_seq_fs.clear();
-        ref_seq_fs.seekg(0, ios::beg);
+void ShortReadMapper::countRange(long begin, long end, int thread_id) {
+    // Count the same seeds trainRange() adds to the Bloom filters
+    vector<uint64_t> seeds;
+    vector<uint8_t> valid;
+    for (long chunk = begin; chunk < end; chunk += REF_CHUNK_SIZE) {
+        long chunk_end = min(chunk + REF_CHUNK_SIZE, end);
+        collectSeeds(chunk, chunk_end, seeds, valid);
+        for (long i = 0; i < chunk_end - chunk; i++) {
+            if (valid[i]) _seed_counter->add(seeds[i], thread_id);
+        }
     }
+}
 
-    // Parse the ref file line by line
-    while (ref_seq_fs >> line) {
-        // If the line starts with '>', ignore it
-        if (line[0] == '>') continue;
+void ShortReadMapper::countWorker(atomic<long>& next_range, int thread_id) {
+    long range_num = (_ref_len + _seed_range[0] - 1) / _seed_range[0];
+    while (true) {
+        long range = next_range.fetch_add(1);
+        if (range >= range_num) break;
 
-        // For each character, generate a seed
-        for (int i = 0; i < line.size(); i++) {
-            updateSeed(line[i], seed);
-            updateRefSeq(line[i], base_cnt);
+        long begin = range * _seed_range[0];
+        long end = min(begin + _seed_range[0], _ref_len);
+        countRange(begin, end, thread_id);
+    }
+}
 
-            // If the seed variable contains more than seed_len seeds,
-            // start updating the Bloom filter.
-            if (base_cnt >= _seed_len - 1) {
-                if (ignoreSatellite) {
-                    int cnt = getCount(_seed_cnt, seed);
-                    if (cnt <= _satellite_threshold) {
-                        _layers[0]->update(seed, base_cnt);
-                        _layers[1]->update(seed, base_cnt);
-                        _layers[2]->update(seed, base_cnt);
-                    }
-                }
-                else {
-                    // Normal mode
-                    _layers[0]->update(seed, base_cnt);
-                    _layers[1]->update(seed, base_cnt);
-                    _layers[2]->update(seed, base_cnt);
-                }
-            }
+void ShortReadMapper::countSeeds() {
+    delete _seed_counter;
+    _seed_counter = new SeedCounter(_seed_count_mode, _seed_len,
+                                    _satellite_threshold, _ref_len, _thread_num);
 
-            base_cnt += 1;
-            if (base_cnt % 10000000 == 0)
-                cout << "[trainBF] Processed " << base_cnt << " seeds" << endl;
-            if (base_cnt == _ref_size) break;
+    int pass_num = _seed_counter->getPassNum();
+    for (int pass = 0; pass < pass_num; pass++) {
+        _seed_counter->startPass(pass);
+        if (_thread_num == 1) {
+            countRange(0, _ref_len, 0);
         }
+        else {
+            atomic<long> next_range(0);
+            vector<thread> workers;
+            for (int t = 0; t < _thread_num; t++) {
+                workers.push_back(thread(&ShortReadMapper::countWorker, this,
+                                         ref(next_range), t));
+            }
+            for (int t = 0; t < _thread_num; t++) {
+                workers[t].join();
+            }
+        }
+        _seed_counter->finishPass();
+        cout << "[countSeeds] Counted pass " << pass + 1 << "/" << pass_num
+             << endl;
+    }
+
+    if (_seed_count_mode == EXACT_COUNT) {
+        cout << "[countSeeds] " << _seed_counter->getFrequentNum()
+             << " seeds occur more than " << _satellite_threshold << " times"
+             << endl;
     }
+    cout << "[countSeeds] Counter memory: "
+         << _seed_counter->getMemSize() / (1024 * 1024) << " MB" << endl;
+}
+
+void ShortReadMapper::trainBF(bool ignoreSatellite) {
+    cout << "[trainBF] Start training the Bloom filter" << endl;
+    if (ignoreSatellite) cout << "[trainBF] Ignore satellite DNA" << endl;
+    _ignore_satellite = ignoreSatellite;
 
-    // printSeedCnt(_seed_cnt);
+    _training_timer.reset();
+    _training_timer.start();
 
-    // Pause stopwatch
-    _training_sw->pause();
+    scanRef();
+    allocLayers();
+    loadRef();
+
+    // If ignoreSatellite, count every seed of the reference first
+    if (ignoreSatellite) countSeeds();
+
+    if (_thread_num == 1) {
+        trainRange(0, _ref_len, ignoreSatellite, false);
+    }
+    else {
+        // Each layer-0 Bloom filter covers a disjoint range of the
+        // reference, so the ranges can be trained independently.
+        atomic<long> next_range(0);
+        vector<thread> workers;
+        for (int t = 0; t < _thread_num; t++) {
+            workers.push_back(thread(&ShortReadMapper::trainWorker, this,
+                                     ref(next_range), ignoreSatellite));
+        }
+        for (int t = 0; t < _thread_num; t++) {
+            workers[t].join();
+        }
+    }
+
+    _training_timer.pause();
 }
 
-void ShortReadMapper::writeBF() {
-    // Currently not used
-    _layers[0]->write_bf_bin("layer1_bf.dat");
-    _layers[1]->write_bf_bin("layer2_bf.dat");
-    _layers[2]->write_bf_bin("layer3_bf.dat");
+bool ShortReadMapper::statRef(int64_t& size, int64_t& mtime) {
+    // Size and modification time of the reference FASTA
+    struct stat st;
+    if (stat(_ref_path.c_str(), &st) != 0) return false;
+    size = st.st_size;
+    mtime = st.st_mtime;
+    return true;
 }
 
-void ShortReadMapper::readBF() {
-    // Currently not used
-    _layers[0]->read_bf_bin("layer1_bf.dat");
-    _layers[1]->read_bf_bin("layer2_bf.dat");
-    _layers[2]->read_bf_bin("layer3_bf.dat");
+void ShortReadMapper::writeIndex(string path) {
+    cout << "[writeIndex] Write index to " << path << endl;
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    header.layer_num = _layer_num;
+    header.seed_len = _seed_len;
+    header.ref_len = _ref_len;
+    header.mem_arrangement = _layers[0]->getMemArrangement();
+
+    // Strides only apply to querying, the filters hold every seed
+    if (_seed_selector->isSampled()) {
+        header.seed_select_mode = _seed_selector->getMode();
+        header.seed_select_param = _seed_selector->getParam();
+    }
+    else {
+        header.seed_select_mode = STRIDE_SEEDS;
+        header.seed_select_param = 1;
+    }
+
+    // Inputs that loadIndex() checks before reusing the index
+    statRef(header.ref_file_size, header.ref_file_mtime);
+    header.ignore_satellite = _ignore_satellite;
+    header.satellite_threshold = _satellite_threshold;
+    header.seed_count_mode = _seed_count_mode;
+
+    IndexFile index(path);
+    index.create();
+    for (int i = 0; i < _layer_num; i++) {
+        header.bf_size[i] = _bf_size[i];
+        header.bf_amount[i] = _bf_amount[i];
+        header.bf_total[i] = _bf_total[i];
+        header.seed_range[i] = _seed_range[i];
+        header.hash_factor[i] = _layers[i]->getHashFactor();
+        header.hash_num[i] = _hash_num[i];
+        header.layer_bytes[i] = _layers[i]->getMemSize() * sizeof(int);
+        header.layer_offset[i] = index.appendSection(
+            _layers[i]->getMemory(), header.layer_bytes[i]);
+    }
+
+    header.ref_bytes = _ref_seq->getDataBytes();
+    header.ref_offset =
+        index.appendSection(_ref_seq->getData(), header.ref_bytes);
+
+    const vector<AmbiguousRun>& runs = _ref_seq->getAmbiguous();
+    header.ambiguous_num = runs.size();
+    header.ambiguous_offset = index.appendSection(
+        runs.data(), header.ambiguous_num * sizeof(AmbiguousRun));
+
+    const vector<Contig>& contigs = _ref_seq->getContigs();
+    vector<int64_t> contig_begins;
+    string contig_names;
+    for (int i = 0; i < contigs.size(); i++) {
+        contig_begins.push_back(contigs[i].begin);
+        contig_names += contigs[i].name + '\0';
+    }
+    header.contig_num = contigs.size();
+    header.contig_offset = index.appendSection(
+        contig_begins.data(), header.contig_num * sizeof(int64_t));
+    header.contig_name_bytes = contig_names.size();
+    header.contig_name_offset = index.appendSection(contig_names.data(),
+                                                    contig_names.size());
+
+    index.finish(header);
 }
 
-void ShortReadMapper::mapRead() {
-    cout << "[mapRead] Start mapping the reads" << endl;
+bool ShortReadMapper::loadIndex(string path, bool ignoreSatellite) {
+    /*
+    Attach the layers and the reference to a memory-mapped index file.
+    Return false if there is no usable index at the path, or if it was
+    trained from another reference file, with another seed length, seed
+    selection, layer hierarchy or other satellite settings.
+    */
+    IndexFile* index = new IndexFile(path);
+    if (!index->open()) {
+        delete index;
+        return false;
+    }
+    cout << "[loadIndex] Load index from " << path << endl;
+
+    IndexHeader* header = index->getHeader();
+
+    // The index holds the reference, so it is still usable without the
+    // FASTA it was built from.
+    int64_t ref_file_size, ref_file_mtime;
+    string stale;
+    if (!statRef(ref_file_size, ref_file_mtime))
+        cout << "[loadIndex] Cannot check " << _ref_path << ", use the index"
+             << endl;
+    else if (ref_file_size != header->ref_file_size ||
+             ref_file_mtime != header->ref_file_mtime)
+        stale = _ref_path + " changed";
+
+    // Filters holding every seed can be queried with any selection, a
+    // sampled index only with the seeds it was trained with
+    if (header->layer_num < 1 || header->mem_arrangement != INTERLEAVED)
+        stale = "layout is not supported";
+    else if (header->seed_len != _seed_len)
+        stale = "seed length differs";
+    else if (header->seed_select_mode != STRIDE_SEEDS &&
+             (header->seed_select_mode != _seed_select_mode ||
+              header->seed_select_param != _seed_select_param))
+        stale = "seed selection differs";
+    else if (header->ignore_satellite != ignoreSatellite)
+        stale = "ignoreSatellite differs";
+    else if (ignoreSatellite &&
+             (header->satellite_threshold != _satellite_threshold ||
+              header->seed_count_mode != _seed_count_mode))
+        stale = "satellite threshold or seed count mode differs";
+    bool same_layers = header->layer_num == _layer_num;
+    for (int i = 0; same_layers && i < _layer_num; i++) {
+        long amount = i == 0 ? fitRootAmount(header->ref_len) : _bf_amount[i];
+        same_layers = header->bf_size[i] == _bf_size[i] &&
+                      header->bf_amount[i] == amount &&
+                      header->seed_range[i] == _seed_range[i] &&
+                      header->hash_num[i] == _hash_num[i];
+    }
+    if (!same_layers) stale = "layer hierarchy differs";
+    if (!stale.empty()) {
+        cout << "[loadIndex] Index is stale, " << stale << endl;
+        delete index;
+        return false;
+    }
+    _ignore_satellite = ignoreSatellite;
 
-    // Start stopwatch
-    _seeding_sw->start();
+    // Replace the configured layers with the ones stored in the index
+    freeLayers();
 
-    // Open read file
-    ifstream read_seq_fs(_read_path);
-    if (!read_seq_fs.is_open()) {
-        cerr << "[mapRead] Cannot open the read sequence file." << endl;
+    _layer_num = header->layer_num;
+    _bf_size = new long[_layer_num];
+    _bf_amount = new long[_layer_num];
+    _bf_total = new long[_layer_num];
+    _seed_range = new long[_layer_num];
+    _hash_num = new int[_layer_num];
+    _layers = new Layer*[_layer_num];
+    for (int i = 0; i < _layer_num; i++) {
+        _bf_size[i] = header->bf_size[i];
+        _bf_amount[i] = header->bf_amount[i];
+        _bf_total[i] = header->bf_total[i];
+        _seed_range[i] = header->seed_range[i];
+        _hash_num[i] = header->hash_num[i];
+        _layers[i] = new Layer(_bf_size[i], _bf_amount[i], _bf_total[i],
+                               _seed_range[i], header->hash_factor[i],
+                               _hash_num[i]);
+
+        if (header->layer_bytes[i] != _layers[i]->getMemSize() * sizeof(int)) {
+            cerr << "[loadIndex] Layer " << i << " size mismatch in " << path
+                 << endl;
+            exit(1);
+        }
+        _layers[i]->attach((int*)index->getSection(header->layer_offset[i],
+                                                   header->layer_bytes[i]));
+    }
+
+    // Attach the reference
+    _ref_len = header->ref_len;
+    if (header->ref_bytes != (_ref_len + 3) / 4) {
+        cerr << "[loadIndex] Reference size mismatch in " << path << endl;
         exit(1);
     }
+    uint8_t* ref_data =
+        (uint8_t*)index->getSection(header->ref_offset, header->ref_bytes);
+    AmbiguousRun* runs = (AmbiguousRun*)index->getSection(
+        header->ambiguous_offset,
+        header->ambiguous_num * sizeof(AmbiguousRun));
+    _ref_seq->attach(ref_data, _ref_len, runs, header->ambiguous_num);
+
+    int64_t* contig_begins = (int64_t*)index->getSection(
+        header->contig_offset, header->contig_num * sizeof(int64_t));
+    const char* contig_name = (const char*)index->getSection(
+        header->contig_name_offset, header->contig_name_bytes);
+    for (long i = 0; i < header->contig_num; i++) {
+        _ref_seq->addContig(contig_name, contig_begins[i]);
+        contig_name += strlen(contig_name) + 1;
+    }
 
-    // Read header
-    string line;
-    while (getline(read_seq_fs, line)) {
-        if (line == "##Header End") break;
-    }
-
-    // Read reads
-    int read_cnt = 0;
-    string token;
-    string golden_loc_s;
-    string fwd_rev;
-    string read;
-
-    while (read_cnt < _test_num) {
-        /* Read format:
-        >chr1  chr1-1536540  116446253  -
-        <Original sequence>
-        <Simulater generated sequence>
-        */
+    delete _index;
+    _index = index;
 
-        read_seq_fs >> token;         // Ignore reference sequence name
-        read_seq_fs >> token;         // Ignore read name
-        read_seq_fs >> golden_loc_s;  // Get golden location
-        read_seq_fs >> fwd_rev;       // Get forward/reverse
-        read_seq_fs >> token;         // Ignore original sequence
-        read_seq_fs >> read;          // Get simulator generated read sequence
+    cout << "[loadIndex] Loaded " << _layer_num << " layers and " << _ref_len
+         << " bases" << endl;
+    if (_mem_config.numa != NUMA_REPLICATE)
+        cout << "[loadIndex] Layers and reference stay in the page cache, "
+                "huge page and NUMA options only apply to replicas"
+             << endl;
+    return true;
+}
 
-        long golden_loc = stol(golden_loc_s);
+void ShortReadMapper::mapReadWorker(ReadSource& source, MapContext& ctx) {
+    /*
+    Walk up to _walk_num reads of the batch at once, one step of each
+    read in turn. A read whose walk is done is aligned and its slot
+    takes the next read of the batch.
+    */
+    vector<ReadWalk>& walks = ctx.walks;
+    if (ctx.node >= 0) bindThreadToNode(ctx.node);
+    while (true) {
+        // Take the next parsed batch of reads
+        ReadBatch* batch = source.nextBatch();
+        if (batch == NULL) break;
+
+        int read_num = batch->reads.size();
+        int next_read = 0;
+        int active_num = 0;
+        ctx.metrics.mapping.start();
+        for (int w = 0; w < walks.size() && next_read < read_num; w++) {
+            startWalk(ctx, walks[w], batch->reads[next_read++]);
+            active_num++;
+        }
+        while (active_num > 0) {
+            for (int w = 0; w < active_num; w++) {
+                ReadWalk& walk = walks[w];
+                if (!walk.nodes.empty()) stepWalk(ctx, walk);
+                if (!walk.nodes.empty()) continue;
+
+                finishWalk(ctx, walk);
+                if (next_read < read_num) {
+                    startWalk(ctx, walk, batch->reads[next_read++]);
+                }
+                else {
+                    // Keep the active walks in front
+                    swap(walks[w], walks[--active_num]);
+                    w--;
+                }
+            }
+        }
+        ctx.metrics.mapping.pause();
+        if (_output != NULL && !ctx.output.empty())
+            _output->push(ctx.output_id, ctx.output);
+        source.releaseBatch(batch);
+    }
+}
 
-        // Only map the forward sequence, ignore the reverse sequence
-        if (fwd_rev == "-") continue;
+void ShortReadMapper::mapRead() {
+    cout << "[mapRead] Start mapping the reads with " << _thread_num
+         << " thread(s)" << endl;
 
-        long bf_idx1 = golden_loc / (256 * 256 * 256);
-        long bf_idx2 = (golden_loc % (256 * 256 * 256)) / (256 * 256);
-        long bf_idx3 = (golden_loc % (256 * 256)) / (256);
-        // cout << "\n" << read << endl;
-        // cout << "golden loc: " << golden_loc;
-        // cout << " (" << bf_idx1 << ", " << bf_idx2 << ", " << bf_idx3 << ")"
-        //      << endl;
+    // Parse the reads on a separate thread, two batches per mapper
+    ReadSource source(_read_path, 2 * _thread_num);
+    if (!source.open()) {
+        cerr << "[mapRead] Cannot open the read sequence file." << endl;
+        exit(1);
+    }
+    source.start();
 
-        // Query the read in each layer recursively
-        initQuery();
-        int layer_id = 0;
-        long hier_offset = 0;
-        long base_offset = 0;
-        int rv = queryLayer(read, layer_id, hier_offset, base_offset);
+    /*
+    With NUMA_REPLICATE, every node gets a copy of the layers and the
+    reference, and the threads mapping on a node read its copy. Threads
+    are spread over the nodes in turn.
+    */
+    int node_num = 0;
+    if (_mem_config.numa == NUMA_REPLICATE) node_num = getNumaNodeNum();
+    if (node_num == 1) {
+        cout << "[mapRead] One NUMA node, nothing to replicate" << endl;
+        node_num = 0;
+    }
+    vector<vector<Layer*> > node_layers(node_num);
+    vector<PackedRefSeq*> node_refs(node_num);
+    for (int n = 0; n < node_num; n++) {
+        long bytes = 0;
+        for (int i = 0; i < _layer_num; i++) {
+            node_layers[n].push_back(_layers[i]->replicate(_mem_config, n));
+            bytes += node_layers[n][i]->getBlock().bytes;
+        }
+        node_refs[n] = _ref_seq->replicate(_mem_config, n);
+        cout << "[mapRead] Node " << n << ": " << (bytes >> 20)
+             << " MB of layers, reference "
+             << describeMemory(node_refs[n]->getBlock()) << endl;
+    }
 
-        // Get mapped location from the BML selector
-        long mapped_loc = _bml_sel->getMapLoc();
-        bool verbose = false;
-        updateScoreboard(rv, golden_loc, mapped_loc, verbose);
+    // Every thread owns its BML selector, hit count and scoreboard
+    vector<MapContext> ctxs(_thread_num);
+    for (int t = 0; t < _thread_num; t++) {
+        ctxs[t].layers = _layers;
+        ctxs[t].ref_seq = _ref_seq;
+        ctxs[t].node = -1;
+        if (node_num > 0) {
+            ctxs[t].node = t % node_num;
+            ctxs[t].layers = node_layers[ctxs[t].node].data();
+            ctxs[t].ref_seq = node_refs[ctxs[t].node];
+        }
+        ctxs[t].bml_sel = new BMLSelector(_seed_len);
+        ctxs[t].bml_sel->setBandWidth(_band_width);
+        ctxs[t].seed_sel = new SeedSelector(*_seed_selector);
+        ctxs[t].walks.resize(_walk_num);
+        ctxs[t].scoreboard.reset();
+        ctxs[t].metrics.reset(_layer_num);
+        ctxs[t].output_id = t;
+    }
 
-        read_cnt += 1;
-        if (read_cnt % 1000 == 0)
-            cout << "[mapRead] Processed " << read_cnt << " reads" << endl;
+    // Records go through the rings of a writer thread
+    if (!_output_path.empty()) {
+        _output = new OutputWriter(_output_path, _output_format, _thread_num);
+        if (!_output->open()) {
+            cerr << "[mapRead] Cannot open " << _output_path << endl;
+            exit(1);
+        }
+        if (_output_format == SAM_FORMAT) writeSamHeader();
+        _output->start();
+    }
+
+    // Map the reads. The calling thread is used as the last worker.
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < _thread_num - 1; t++) {
+        workers.push_back(thread(&ShortReadMapper::mapReadWorker, this,
+                                 ref(source), ref(ctxs[t])));
+    }
+    mapReadWorker(source, ctxs[_thread_num - 1]);
+    for (int t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    if (ctxs[_thread_num - 1].node >= 0) unbindThread();
+    if (_output != NULL) _output->finish();
+    _map_wall_sec =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    _mapped_read_cnt = source.getReadCnt();
+    cout << "[mapRead] Mapped " << _mapped_read_cnt << " reads" << endl;
+    if (_output != NULL) {
+        cout << "[mapRead] Wrote " << _output->getBytes() << " bytes to "
+             << _output_path << endl;
+        delete _output;
+        _output = NULL;
     }
 
-    // pause stopwatch
-    _seeding_sw->pause();
+    // Merge the per-thread results
+    _metrics.reset(_layer_num);
+    _thread_metrics.clear();
+    for (int t = 0; t < _thread_num; t++) {
+        ctxs[t].scoreboard.ungapped_path =
+            ctxs[t].bml_sel->getUngappedReadCnt();
+        ctxs[t].scoreboard.gapped_path = ctxs[t].bml_sel->getGappedReadCnt();
+        ctxs[t].scoreboard.banded_cand = ctxs[t].bml_sel->getBandedCandCnt();
+        ctxs[t].scoreboard.full_cand = ctxs[t].bml_sel->getFullCandCnt();
+        ctxs[t].scoreboard.dp_cells = ctxs[t].bml_sel->getDPCellCnt();
+        _scoreboard.add(ctxs[t].scoreboard);
+        _metrics.add(ctxs[t].metrics);
+        _thread_metrics.push_back(ctxs[t].metrics);
+        delete ctxs[t].bml_sel;
+        delete ctxs[t].seed_sel;
+    }
+    for (int n = 0; n < node_num; n++) {
+        for (int i = 0; i < _layer_num; i++) {
+            delete node_layers[n][i];
+        }
+        delete node_refs[n];
+    }
 }
 
 void ShortReadMapper::displayResult() {
-    int sum = _correctly_mapped + _wrongly_mapped + _satellite + _not_mapped;
+    int sum = _scoreboard.correctly_mapped + _scoreboard.wrongly_mapped +
+              _scoreboard.unverified + _scoreboard.satellite +
+              _scoreboard.not_mapped;
 
     cout << "\n---- Mapping Result ----" << endl;
-    cout << "Correctly mapped: " << setw(5) << _correctly_mapped << endl;
-    cout << "Wrongly mapped:   " << setw(5) << _wrongly_mapped << endl;
-    cout << "Satellite:        " << setw(5) << _satellite << endl;
-    cout << "Not mapped:       " << setw(5) << _not_mapped << endl;
+    cout << "Correctly mapped: " << setw(5) << _scoreboard.correctly_mapped
+         << endl;
+    cout << "Wrongly mapped:   " << setw(5) << _scoreboard.wrongly_mapped
+         << endl;
+    if (_scoreboard.unverified > 0) {
+        cout << "Mapped, no truth: " << setw(5) << _scoreboard.unverified
+             << endl;
+    }
+    cout << "Satellite:        " << setw(5) << _scoreboard.satellite << endl;
+    cout << "Not mapped:       " << setw(5) << _scoreboard.not_mapped << endl;
     cout << "Total:            " << setw(5) << sum << endl;
 
+    cout << "\n---- Alignment Path ----" << endl;
+    cout << "Ungapped only:    " << setw(5) << _scoreboard.ungapped_path
+         << endl;
+    cout << "Smith-Waterman:   " << setw(5) << _scoreboard.gapped_path << endl;
+    cout << "Banded windows:   " << setw(5) << _scoreboard.banded_cand << endl;
+    cout << "Full windows:     " << setw(5) << _scoreboard.full_cand << endl;
+    long dp_cand = _scoreboard.banded_cand + _scoreboard.full_cand;
+    cout << "DP cells/window:  " << setw(5)
+         << (dp_cand ? _scoreboard.dp_cells / dp_cand : 0) << endl;
+
+    cout << "\n---- Seeding ----" << endl;
+    cout << "Seeds/read:       " << setw(5)
+         << (sum ? _scoreboard.seeds / sum : 0) << endl;
+    cout << "Queries/read:     " << setw(5)
+         << (sum ? _scoreboard.seed_queries / sum : 0) << endl;
+    cout << "CMLs/read:        " << setw(5) << fixed << setprecision(2)
+         << (sum ? (double)_scoreboard.cmls / sum : 0) << endl;
+    cout << "Regions/read:     " << setw(5)
+         << (sum ? (double)_scoreboard.regions / sum : 0) << endl;
+    cout << "Over budget:      " << setw(5) << _metrics.over_budget << endl;
+
+    // Seeding and seed extraction are summed over the mapping threads,
+    // the mapping time is elapsed time and shows the parallel speedup.
+    double seed_extraction_sec = _metrics.seed_extraction.getSec();
     cout << "\n---- Duration (sec) ----" << endl;
     cout << fixed << setprecision(2);
-    cout << "Training:         " << setw(5) << _training_sw->getSec() << endl;
-    cout << "Seeding:          " << setw(5) << _seeding_sw->getSec() << endl;
-    cout << "Seed extraction:  " << setw(5) << _seed_extraction_sw->getSec()
+    cout << "Training:         " << setw(5) << _training_timer.getSec()
+         << endl;
+    cout << "Seeding:          " << setw(5)
+         << _metrics.mapping.getSec() - seed_extraction_sec << endl;
+    cout << "Seed extraction:  " << setw(5) << seed_extraction_sec << endl;
+    cout << "Mapping (wall):   " << setw(5) << _map_wall_sec << endl;
+    cout << setprecision(0);
+    cout << "Reads/s:          " << setw(5)
+         << (_map_wall_sec > 0 ? _mapped_read_cnt / _map_wall_sec : 0) << endl;
+
+    LatencyHistogram& latency = _metrics.latency;
+    cout << "\n---- Read latency (us) ----" << endl;
+    cout << "p50:              " << setw(5) << latency.getPercentile(50) * 1e6
          << endl;
+    cout << "p99:              " << setw(5) << latency.getPercentile(99) * 1e6
+         << endl;
+    cout << "p99.9:            " << setw(5)
+         << latency.getPercentile(99.9) * 1e6 << endl;
+}
+
+void ShortReadMapper::writeMetrics(string path) {
+    /*
+    Write the scoreboard, the per-layer walk counters, the read latencies
+    and the durations of the last run as JSON, for scripts comparing runs.
+    Latencies are in microseconds, durations in seconds.
+    */
+    ofstream os(path);
+    if (!os.is_open()) {
+        cerr << "[writeMetrics] Cannot open " << path << endl;
+        exit(1);
+    }
+    long reads = max(1L, _metrics.reads);
+    os << fixed << setprecision(3);
+
+    os << "{\n  \"reads\": " << _metrics.reads << ",\n";
+    os << "  \"result\": {\"correctly_mapped\": "
+       << _scoreboard.correctly_mapped
+       << ", \"wrongly_mapped\": " << _scoreboard.wrongly_mapped
+       << ", \"unverified\": " << _scoreboard.unverified
+       << ", \"satellite\": " << _scoreboard.satellite
+       << ", \"not_mapped\": " << _scoreboard.not_mapped << "},\n";
+    os << "  \"alignment\": {\"ungapped_reads\": "
+       << _scoreboard.ungapped_path
+       << ", \"gapped_reads\": " << _scoreboard.gapped_path
+       << ", \"banded_windows\": " << _scoreboard.banded_cand
+       << ", \"full_windows\": " << _scoreboard.full_cand
+       << ", \"dp_cells\": " << _scoreboard.dp_cells << "},\n";
+    os << "  \"seeding\": {\"seeds_per_read\": "
+       << (double)_scoreboard.seeds / reads
+       << ", \"probes_per_read\": " << (double)_scoreboard.seed_queries / reads
+       << ", \"cmls_per_read\": " << (double)_scoreboard.cmls / reads
+       << ", \"regions_per_read\": " << (double)_scoreboard.regions / reads
+       << ", \"no_seed_reads\": " << _metrics.no_seed
+       << ", \"over_budget_reads\": " << _metrics.over_budget << "},\n";
+
+    os << "  \"layers\": [";
+    for (int i = 0; i < _layer_num; i++) {
+        os << (i ? ",\n    " : "\n    ") << "{\"layer\": " << i
+           << ", \"nodes\": " << _metrics.layer_nodes[i]
+           << ", \"probes\": " << _metrics.layer_probes[i]
+           << ", \"probes_per_read\": "
+           << (double)_metrics.layer_probes[i] / reads
+           << ", \"satellite_rejects\": " << _metrics.layer_satellite[i]
+           << ", \"unmapped_rejects\": " << _metrics.layer_unmapped[i] << "}";
+    }
+    os << "\n  ],\n";
+
+    LatencyHistogram& latency = _metrics.latency;
+    os << "  \"latency_us\": {\"p50\": " << latency.getPercentile(50) * 1e6
+       << ", \"p99\": " << latency.getPercentile(99) * 1e6
+       << ", \"p999\": " << latency.getPercentile(99.9) * 1e6
+       << ", \"max\": " << latency.getMax() * 1e6 << "},\n";
+
+    double seed_extraction_sec = _metrics.seed_extraction.getSec();
+    os << "  \"duration_sec\": {\"training\": " << _training_timer.getSec()
+       << ", \"seeding\": "
+       << _metrics.mapping.getSec() - seed_extraction_sec
+       << ", \"seed_extraction\": " << seed_extraction_sec
+       << ", \"mapping_wall\": " << _map_wall_sec << "},\n";
+
+    os << "  \"threads\": [";
+    for (int t = 0; t < _thread_metrics.size(); t++) {
+        MapMetrics& metrics = _thread_metrics[t];
+        os << (t ? ",\n    " : "\n    ") << "{\"reads\": " << metrics.reads
+           << ", \"mapping_sec\": " << metrics.mapping.getSec()
+           << ", \"seed_extraction_sec\": " << metrics.seed_extraction.getSec()
+           << ", \"latency_p99_us\": "
+           << metrics.latency.getPercentile(99) * 1e6 << "}";
+    }
+    os << "\n  ]\n}\n";
+
+    cout << "[writeMetrics] Write metrics to " << path << endl;
 }
@@ -1,33 +1,166 @@
 
+#include <atomic>
 #include <cstdlib>
-#include <ctime>
 #include <string>
-#include <unordered_map>
+#include <vector>
 
 #include "bml_selector.h"
+#include "index_file.h"
 #include "layer.h"
+#include "metrics.h"
+#include "output_writer.h"
+#include "packed_ref_seq.h"
+#include "read_source.h"
+#include "seed_counter.h"
+#include "seed_selector.h"
 
 using namespace std;
 
 #ifndef __SHORT_SEQ_MAPPER__
 #define __SHORT_SEQ_MAPPER__
 
-class Stopwatch {
-   private:
-    clock_t _duration;
-    clock_t _start_time;
+struct Scoreboard {
+    int correctly_mapped;
+    int wrongly_mapped;
+    int satellite;
+    int not_mapped;
+
+    // Mapped reads without a golden location to check against
+    int unverified;
+
+    // Reads aligned by the ungapped pre-check alone or with the DP
+    long ungapped_path;
+    long gapped_path;
+
+    // Windows aligned in the band or over the whole matrix, DP cells
+    long banded_cand;
+    long full_cand;
+    long dp_cells;
+
+    // Seeds selected from the reads, and Bloom filter queries made with them
+    long seeds;
+    long seed_queries;
+
+    // CMLs aligned, most of them false hits of the last layer, and the
+    // regions their merged windows make up
+    long cmls;
+    long regions;
 
-   public:
     void reset() {
-        _duration = 0;
-        _start_time = 0;
+        correctly_mapped = 0;
+        wrongly_mapped = 0;
+        satellite = 0;
+        not_mapped = 0;
+        unverified = 0;
+        ungapped_path = 0;
+        gapped_path = 0;
+        banded_cand = 0;
+        full_cand = 0;
+        dp_cells = 0;
+        seeds = 0;
+        seed_queries = 0;
+        cmls = 0;
+        regions = 0;
     }
-    void start() { _start_time = clock(); }
-    void pause() {
-        _duration += clock() - _start_time;
-        _start_time = 0;
+    void add(const Scoreboard& other) {
+        correctly_mapped += other.correctly_mapped;
+        wrongly_mapped += other.wrongly_mapped;
+        satellite += other.satellite;
+        not_mapped += other.not_mapped;
+        unverified += other.unverified;
+        ungapped_path += other.ungapped_path;
+        gapped_path += other.gapped_path;
+        banded_cand += other.banded_cand;
+        full_cand += other.full_cand;
+        dp_cells += other.dp_cells;
+        seeds += other.seeds;
+        seed_queries += other.seed_queries;
+        cmls += other.cmls;
+        regions += other.regions;
     }
-    float getSec() { return (float)_duration / (float)CLOCKS_PER_SEC; }
+};
+
+// Bloom filters of one layer below a parent Bloom filter, queried for the
+// strands in strand_mask. hit_cnt is the best hit count of the parent on
+// those strands, which ranks the node among the others of the read.
+struct WalkNode {
+    int layer_id;
+    long hier_offset;
+    long base_offset;
+    int strand_mask;
+    int hit_cnt;
+};
+
+/*
+Layer walk of one read. A mapping thread walks several reads at once: each
+step queries the node prefetched at the previous step of the read, then
+prefetches the next one and moves on to the next read, so the cache misses
+of different reads overlap.
+*/
+struct ReadWalk {
+    Read* read;
+    string read_seq;
+
+    // Selected seeds of both strands and their hit threshold
+    vector<uint64_t> seeds[STRAND_NUM];
+    long hit_threshold[STRAND_NUM];
+
+    // Bloom filters with enough hits so far, per strand and layer
+    vector<int> layer_hit_cnt;
+
+    // Heap of the nodes left to query, the best one first, and the CMLs
+    // found
+    vector<WalkNode> nodes;
+    vector<pair<long, int> > cmls;
+    int rv;
+
+    // Seed queries made so far, and whether the walk stopped at its
+    // probe or CML budget with nodes left
+    long probes;
+    bool over_budget;
+
+    // Deepest layer queried so far, -1 before the first step, and when
+    // the walk started
+    int depth;
+    double start_time;
+};
+
+// Per-thread mapping state. The trained layers and the reference sequence
+// are only read while mapping, so everything that is written lives here.
+struct MapContext {
+    BMLSelector* bml_sel;
+    SeedSelector* seed_sel;
+
+    // Layers and reference the thread reads, the copies of its NUMA node
+    // when they are replicated, and that node, -1 if none
+    Layer** layers;
+    PackedRefSeq* ref_seq;
+    int node;
+
+    // Scratch space of extractSeeds()
+    vector<uint64_t> all_seeds[STRAND_NUM];
+    vector<uint8_t> keep;
+
+    // Scratch space of a walk step: hit counts and the Bloom filters with
+    // enough hits, per strand
+    vector<uint8_t> hit_cnt[STRAND_NUM];
+    vector<int> hit_bf[STRAND_NUM];
+
+    // Scratch space of finishWalk(): [begin, end) of the reference
+    // regions to align, per strand
+    vector<pair<long, long> > regions[STRAND_NUM];
+
+    // Reads walked at once
+    vector<ReadWalk> walks;
+
+    Scoreboard scoreboard;
+    MapMetrics metrics;
+
+    // Ring of the output writer this thread pushes to, the records of
+    // the current batch and the alignment of the current read
+    int output_id;
+    string output;
+    Alignment aln;
 };
 
 class ShortReadMapper {
@@ -51,51 +184,118 @@ class ShortReadMapper {
     long* _bf_amount;
     long* _bf_total;
     long* _seed_range;
+    int* _hash_num;
     Layer** _layers;
-    int* _layer_hit_cnt;
 
-    // Mapping configuration
-    long _test_num;
+    // Bloom filters of layer 0 in the configuration. Only the ones
+    // covering the reference are kept, see fitLayers().
+    long _root_amount;
+
+    // Mapping configuration, _ref_size is counted by scanRef()
     long _ref_size;
+    long _ref_len;
+    int _thread_num;
+    int _walk_num;
+    int _band_width;
+
+    // Seed queries and CMLs a read may use before its walk stops, 0 for
+    // no limit
+    long _probe_budget;
+    long _cml_budget;
 
     // Full reference sequence
-    char* _ref_seq;
+    PackedRefSeq* _ref_seq;
+
+    // Pages and NUMA placement of the layers and the reference
+    MemConfig _mem_config;
+
+    // Index file the layers and the reference are attached to, if any
+    IndexFile* _index;
+
+    // Per-read records of mapRead(), none if the path is empty
+    string _output_path;
+    OutputFormat _output_format;
+    OutputWriter* _output;
+
+    // Scoreboard, merged from all mapping threads
+    Scoreboard _scoreboard;
+
+    // Elapsed time of the last mapRead() and the reads it mapped
+    double _map_wall_sec;
+    long _mapped_read_cnt;
+
+    // Seeds used to train and query the Bloom filters
+    SeedSelectMode _seed_select_mode;
+    int _seed_select_param;
+    SeedSelector* _seed_selector;
 
-    // BML selector
-    BMLSelector* _bml_sel;
+    // Share of the kept seeds a CML needs hits from, when the Bloom
+    // filters are trained on minimizers or syncmers only
+    double _sampled_hit_share;
 
-    // Scoreboard
-    int _correctly_mapped;
-    int _wrongly_mapped;
-    int _satellite;
-    int _not_mapped;
+    // Whether the trained Bloom filters ignore satellite DNA
+    bool _ignore_satellite;
 
     // Seed count used to ignore satellite when training BF
-    unordered_map<uint64_t, int> _seed_cnt;
+    SeedCountMode _seed_count_mode;
+    SeedCounter* _seed_counter;
 
-    // Stopwatch
-    Stopwatch* _training_sw;
-    Stopwatch* _seeding_sw;
-    Stopwatch* _seed_extraction_sw;
+    // Elapsed time of the last trainBF(), and the metrics of the last
+    // mapRead(), merged and per thread
+    Timer _training_timer;
+    MapMetrics _metrics;
+    vector<MapMetrics> _thread_metrics;
 
     // Private functions
     void genSeedMask();
-    void updateSeed(char&, uint64_t&);
-    void updateRefSeq(char&, long);
-    void initQuery();
-    int queryLayer(string&, int, long, long);
-    void updateScoreboard(int&, long&, long&, bool);
-    string getRefSeqFromLoc(long, int);
-    bool isSatellite(int, int[]);
+    void genSeedSelector();
+    void genLayers();
+    void freeLayers();
+    void allocLayers();
+    long fitRootAmount(long);
+    void fitLayers(long);
+    void scanRef();
+    void loadRef();
+    bool statRef(int64_t&, int64_t&);
+    long countSkippedSeeds();
+    void collectSeeds(long, long, vector<uint64_t>&, vector<uint8_t>&);
+    void trainRange(long, long, bool, bool);
+    void trainWorker(atomic<long>&, bool);
+    void countRange(long, long, int);
+    void countWorker(atomic<long>&, int);
+    void countSeeds();
+    int extractSeeds(MapContext&, ReadWalk&);
+    void startWalk(MapContext&, ReadWalk&, Read&);
+    void prefetchNode(MapContext&, ReadWalk&);
+    void stepWalk(MapContext&, ReadWalk&);
+    void finishWalk(MapContext&, ReadWalk&);
+    bool isGoldenLoc(Read&, long);
+    void updateScoreboard(Scoreboard&, int&, Read&, long&, bool);
+    void appendSam(MapContext&, ReadWalk&, bool);
+    void appendPaf(MapContext&, ReadWalk&);
+    void writeSamHeader();
+    bool isSatellite(ReadWalk&, int, int, uint8_t[]);
+    void mapReadWorker(ReadSource&, MapContext&);
 
    public:
     ShortReadMapper(string&, string&, long, long, long, long, long, long);
     ~ShortReadMapper();
+    void loadLayerConfig(string);
+    void setThreadNum(int);
+    void setWalkNum(int);
+    void setWalkBudget(long, long);
+    void setBandWidth(int);
+    void setSeedCountMode(SeedCountMode);
+    void setSeedSelectMode(SeedSelectMode, int);
+    void setSampledHitShare(double);
+    void setOutput(string, OutputFormat);
+    void setMemConfig(MemConfig);
     void trainBF(bool);
-    void writeBF();
-    void readBF();
+    void writeIndex(string);
+    bool loadIndex(string, bool);
     void mapRead();
     void displayResult();
+    void writeMetrics(string);
 };
 
 #endif
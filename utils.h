@@ -1,66 +1,84 @@
 #include <cmath>
-#include <map>
-#include <unordered_map>
+#include <cstdint>
+#include <immintrin.h>
+
+#include "cpu_features.h"
 
 using namespace std;
 
-void findAndIncrement(unordered_map<uint64_t, int>& _seed_cnt, uint64_t& seed) {
-    unordered_map<uint64_t, int>::iterator it = _seed_cnt.find(seed);
-    if (it != _seed_cnt.end()) {
-        it->second++;
-    }
-    else {
-        _seed_cnt.insert(make_pair(seed, 1));
+void printHitCnt(int layer, uint8_t hit_cnt[], int amount) {
+    if (layer == 0) {
+        cout << "[index]  ";
+        for (int i = 0; i < amount; i++) {
+            cout << setw(2) << i % 100 << ' ';
+        }
+        cout << endl;
     }
-}
 
-int getCount(unordered_map<uint64_t, int>& _seed_cnt, uint64_t& seed) {
-    unordered_map<uint64_t, int>::const_iterator cnt = _seed_cnt.find(seed);
-    if (cnt == _seed_cnt.end()) {
-        // Not found, throw error
-        cerr << "Seed not found in the _seed_cnt map" << endl;
-        exit(1);
-    }
-    else {
-        return cnt->second;
+    cout << "[layer" << layer << "] ";
+    for (int i = 0; i < amount; i++) {
+        cout << setw(2) << (int)hit_cnt[i] << ' ';
     }
+    cout << endl;
 }
 
-void printSeedCnt(unordered_map<uint64_t, int>& _seed_cnt) {
-    map<int, int> cnt_map;
-    for (const auto& x : _seed_cnt) {
-        map<int, int>::iterator it = cnt_map.find(x.second);
-        if (it != cnt_map.end()) {
-            it->second++;
-        }
-        else {
-            cnt_map.insert(make_pair(x.second, 1));
+TARGET_AVX2 static int collectHitBFAVX2(uint8_t hit_cnt[], int amount,
+                                        uint8_t threshold, int idx[], int& i) {
+    // hit_cnt >= threshold <=> max(hit_cnt, threshold) == hit_cnt
+    int num = 0;
+    __m256i thr = _mm256_set1_epi8(threshold);
+    for (; i + 32 <= amount; i += 32) {
+        __m256i cnt = _mm256_loadu_si256((__m256i*)&hit_cnt[i]);
+        uint32_t mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_max_epu8(cnt, thr), cnt));
+        while (mask != 0) {
+            idx[num++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
         }
     }
-    for (auto const& x : cnt_map) {
-        cout << x.first << ": " << x.second << endl;
-    }
+    return num;
 }
 
-void printHitCnt(int layer, int hit_cnt[], int amount) {
-    if (layer == 0) {
-        cout << "[index]  ";
-        for (int i = 0; i < amount; i++) {
-            cout << setw(2) << i % 100 << ' ';
+int collectHitBF(uint8_t hit_cnt[], int amount, long threshold, int idx[]) {
+    /*
+    Write the indices of the Bloom filters with hit_cnt >= threshold to idx
+    in increasing order, and return how many there are.
+    */
+    if (threshold > 255) return 0;
+    if (threshold < 0) threshold = 0;
+
+    int num = 0;
+    int i = 0;
+    if (cpuHasAVX2()) num = collectHitBFAVX2(hit_cnt, amount, threshold, idx, i);
+    for (; i < amount; i++) {
+        if (hit_cnt[i] >= threshold) {
+            idx[num++] = i;
         }
-        cout << endl;
     }
+    return num;
+}
 
-    cout << "[layer" << layer << "] ";
-    for (int i = 0; i < amount; i++) {
-        cout << setw(2) << hit_cnt[i] << ' ';
+TARGET_AVX2 static int countHitBFAVX2(uint8_t hit_cnt[], int amount,
+                                      uint8_t threshold, int& i) {
+    int sum = 0;
+    __m256i thr = _mm256_set1_epi8(threshold);
+    for (; i + 32 <= amount; i += 32) {
+        __m256i cnt = _mm256_loadu_si256((__m256i*)&hit_cnt[i]);
+        uint32_t mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_max_epu8(cnt, thr), cnt));
+        sum += __builtin_popcount(mask);
     }
-    cout << endl;
+    return sum;
 }
 
-int countHitBF(int hit_cnt[], int amount, int threshold) {
+int countHitBF(uint8_t hit_cnt[], int amount, long threshold) {
+    if (threshold > 255) return 0;
+    if (threshold < 0) threshold = 0;
+
     int sum = 0;
-    for (int i = 0; i < amount; i++) {
+    int i = 0;
+    if (cpuHasAVX2()) sum = countHitBFAVX2(hit_cnt, amount, threshold, i);
+    for (; i < amount; i++) {
         if (hit_cnt[i] >= threshold) {
             sum += 1;
         }
@@ -68,7 +86,7 @@ int countHitBF(int hit_cnt[], int amount, int threshold) {
     return sum;
 }
 
-long meanPlusStdev(int arr[], int len, int N) {
+long meanPlusStdev(uint8_t arr[], int len, int N) {
     float sum = 0;
     float mean;
     float var = 0;
@@ -82,10 +100,10 @@ long meanPlusStdev(int arr[], int len, int N) {
     return (long)mean + N * (long)sqrt(var / len);
 }
 
-int findMax(int arr[], int len) {
+int findMax(uint8_t arr[], int len) {
     int rv = -1;
     for (int i = 0; i < len; i++) {
-        rv = max(rv, arr[i]);
+        rv = max(rv, (int)arr[i]);
     }
     return rv;
 }